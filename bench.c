@@ -0,0 +1,158 @@
+/*  bench.c
+    2026-10-16
+
+    Public Domain
+
+    jsbench times the classification of characters, the way the lexer did it
+    with chains of comparisons, and the way it does it now with the table of
+    class bits. Each way classifies every character of the same 64 MiB of
+    text, and counts the cmd characters and the regexp prefixes, so that the
+    work cannot be skipped and the counts can be checked.
+
+        jsbench [<file>]
+
+    The text is copies of the file, or else of a sample of JavaScript.
+*/
+
+#define JSDEV_LIBRARY
+
+#include "jsdev.c"
+
+#define TEXT_SIZE      67108864
+
+static char* sample =
+    "function f(a, b) {\n"
+    "    var re = /x[/]y/g, s = 'str', t = \"d\";\n"
+    "    /*debug check(a)*/\n"
+    "    if (a === b || !a) { return [a, b]; }\n"
+    "    return a.b$c_d + 42 * (b - 1) / 2;\n"
+    "}\n";
+
+
+static void
+quit(char* message)
+{
+    fprintf(stderr, "jsbench: %s\r\n", message);
+    exit(1);
+}
+
+
+static int
+chain_alphanum(int c)
+{
+    return ((c >= 'a' && c <= 'z') ||
+            (c >= '0' && c <= '9') ||
+            (c >= 'A' && c <= 'Z') ||
+             c == '_' || c == '$' || c == '.');
+}
+
+
+static int
+chain_pre_regexp(int left)
+{
+    return (left == '(' || left == ',' || left == '=' ||
+            left == ':' || left == '[' || left == '!' ||
+            left == '&' || left == '|' || left == '?' ||
+            left == '{' || left == '}' || left == ';');
+}
+
+
+static __attribute__((noinline)) size_t
+by_chains(unsigned char* p, unsigned char* end)
+{
+    size_t n = 0;
+    while (p < end) {
+        n += chain_alphanum(*p) + 2 * chain_pre_regexp(*p);
+        p += 1;
+    }
+    return n;
+}
+
+
+static __attribute__((noinline)) size_t
+by_table(unsigned char* p, unsigned char* end)
+{
+    size_t n = 0;
+    while (p < end) {
+        n += (is(*p, CMD_CHAR) != 0) + 2 * (is(*p, PRE_REGEXP) != 0);
+        p += 1;
+    }
+    return n;
+}
+
+
+static char*
+slurp(int fd)
+{
+    char* s = NULL;
+    size_t size = 0, length = 0;
+    ssize_t n;
+    for (;;) {
+        s = (char*) enlarge(s, &size, length + BLOCK_SIZE + 1);
+        n = read(fd, s + length, BLOCK_SIZE);
+        if (n > 0) {
+            length += n;
+        } else if (n == 0) {
+            break;
+        } else if (errno != EINTR) {
+            quit("read error.");
+        }
+    }
+    s[length] = 0;
+    return s;
+}
+
+
+static unsigned char*
+make_text(char* name)
+{
+/*
+    Fill the text with copies of the file or the sample.
+*/
+    unsigned char* text = (unsigned char*) malloc(TEXT_SIZE);
+    char* piece = sample;
+    size_t length, filled;
+    int fd;
+    if (text == NULL) {
+        quit("out of memory.");
+    }
+    if (name != NULL) {
+        fd = open(name, O_RDONLY);
+        if (fd < 0) {
+            quit(name);
+        }
+        piece = slurp(fd);
+        close(fd);
+    }
+    length = strlen(piece);
+    if (length == 0) {
+        quit("empty text.");
+    }
+    for (filled = 0; filled < TEXT_SIZE; filled += length) {
+        memcpy(text + filled,
+                piece,
+                TEXT_SIZE - filled < length ? TEXT_SIZE - filled : length);
+    }
+    return text;
+}
+
+
+extern int
+main(int argc, char* argv[])
+{
+    unsigned char* text = make_text(argc > 1 ? argv[1] : NULL);
+    double t0, t1, t2;
+    size_t chains, table;
+
+    t0 = now();
+    chains = by_chains(text, text + TEXT_SIZE);
+    t1 = now();
+    table = by_table(text, text + TEXT_SIZE);
+    t2 = now();
+    printf("chains %8.1f ms\ntable  %8.1f ms\n",
+            (t1 - t0) * 1000, (t2 - t1) * 1000);
+    if (chains != table) {
+        quit("the counts differ.");
+    }
+    return 0;
+}
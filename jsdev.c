@@ -56,6 +56,79 @@
 
             A string that will be prepended to the file as a comment.
 
+    There can be more cmds than fit on a command line, so they can also be put
+    in a file.
+
+        -cmds <file>
+
+            Declare the cmds in the file, which are written as they are on the
+            command line, separated by spaces or line breaks.
+
+    A large program can be processed by several threads at once.
+
+        -parallel <threads>
+
+            The number of threads to use. This only applies when the program
+            is read from a file. The output is the same.
+
+    When the program is read from a pipe, reading, processing, and writing
+    can be done by separate threads.
+
+        -pipeline
+
+            Use the three threads.
+
+        -stalls
+
+            Use the three threads, and report on stderr how long each of them
+            spent waiting for the others.
+
+    On Linux, the input and output of a pipe can go through an io_uring.
+
+        -uring
+
+            Use an io_uring if the system allows it.
+
+    Many programs can be processed in one run, so that the command line is only
+    parsed once. Each program gets its own output file. An error in one of them
+    is reported with its file name, its output file is removed, and the others
+    go on. The exit status is 1 if any of them failed. The files are shared by
+    as many threads as there are processors, or by -parallel <threads>. The
+    errors are reported in the order of the files. The other thread options do
+    not apply.
+
+        -dir <directory>
+
+            Write each output file to the same path within the directory.
+
+        -suffix <suffix>
+
+            Write each output file next to its program, with the suffix added
+            to its name.
+
+        -- <file>...
+
+            The rest of the command line is the names of the programs.
+
+        @<list>
+
+            The names of the programs are in the list file, one per line.
+
+        -files0
+
+            The names of the programs are read from stdin, each ending with a
+            NUL character.
+
+    An output can be kept, so that when the same program is processed again
+    with the same cmds and comments, the output is copied instead of made.
+    This only applies when the program is read from a file, and to each file
+    of a batch.
+
+        -cache <directory>
+
+            Keep the outputs in the directory. Nothing is ever removed from
+            it, so clearing it now and then is up to you.
+
     Sample command line:
 
         jsprep debug log:console.log alarm:alert -comment "Devel Edition"
@@ -90,471 +163,5519 @@
 
     at the top of the output file.
 
-    A program is read from stdin, and a modified program is written to stdout.
+    A program is read from stdin, and a modified program is written to stdout,
+    unless there are files to process.
+
+    Compiled with JSDEV_LIBRARY, this file is libjsdev instead, which has no
+    main. Its interface is in jsdev.h. The Makefile builds both.
+
+        jsdev --serve [<socket>]
+
+    runs a daemon that keeps cmd tables ready for jsdevc, a client that is
+    used just like jsdev.
 */
 
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <setjmp.h>
+#include <signal.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <sys/syscall.h>
+#include <linux/fs.h>
+#include <linux/io_uring.h>
+#undef BLOCK_SIZE
+#endif
+#include "jsdev.h"
 
 #define false          0
 #define true           1
-#define MAX_CMD_LENGTH 80
-#define MAX_NR_CMDS    100
+#define BLOCK_SIZE     262144
+#define PADDING        64
+#define TRANSFER_SIZE  65536
+#define MAX_NR_CMDS    16777216
+#define LOCAL          static __thread
 
-static char cmd                  [MAX_CMD_LENGTH + 1];
-static char cmds    [MAX_NR_CMDS][MAX_CMD_LENGTH + 1];
-static char commands[MAX_NR_CMDS][MAX_CMD_LENGTH + 1];
-static int  cr;
-static int  line_nr;
-static int  nr_cmds;
-static int  preview = 0;
+/*
+    Each character, and EOF, has a set of class bits, so that it can be
+    classified with one load. The table is indexed by c + 1, so that EOF is
+    at 0. Each row is labeled with the code of its first character.
+*/
 
-static void
-error(char* message)
-{
-    fputs("JSDev: ", stderr);
-    if (line_nr) {
-        fprintf(stderr, "%d. ", line_nr);
-    } else {
-        fputs("bad command line ", stderr);
-    }
-    fputs(message, stderr);
-    fputs("\r\n", stderr);
-    exit(1);
-}
+#define CMD_CHAR   0x01
+#define PRE_REGEXP 0x02
+#define SPACE      0x04
+#define QUOTE      0x08
+#define OPENER     0x10
+#define CLOSER     0x20
 
+#define is(c, class) (classes[(c) + 1] & (class))
+
+static const unsigned char classes[257] = {
+    /* EOF */ 0x04,
+    /* 00 */  0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04,
+    /* 08 */  0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04,
+    /* 10 */  0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04,
+    /* 18 */  0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04,
+    /* 20 */  0x04, 0x02, 0x08, 0x00, 0x01, 0x00, 0x02, 0x08,
+    /* 28 */  0x12, 0x20, 0x00, 0x00, 0x02, 0x00, 0x01, 0x00,
+    /* 30 */  0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01,
+    /* 38 */  0x01, 0x01, 0x02, 0x02, 0x00, 0x02, 0x00, 0x02,
+    /* 40 */  0x00, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01,
+    /* 48 */  0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01,
+    /* 50 */  0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01,
+    /* 58 */  0x01, 0x01, 0x01, 0x12, 0x00, 0x20, 0x00, 0x01,
+    /* 60 */  0x08, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01,
+    /* 68 */  0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01,
+    /* 70 */  0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01,
+    /* 78 */  0x01, 0x01, 0x01, 0x12, 0x02, 0x22, 0x00, 0x00,
+    /* 80 */  0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    /* 88 */  0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    /* 90 */  0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    /* 98 */  0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    /* A0 */  0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    /* A8 */  0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    /* B0 */  0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    /* B8 */  0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    /* C0 */  0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    /* C8 */  0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    /* D0 */  0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    /* D8 */  0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    /* E0 */  0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    /* E8 */  0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    /* F0 */  0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    /* F8 */  0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+};
 
-static int
-is_alphanum(char c)
-{
 /*
-    Return true if the character is a letter, digit, underscore,
-    dollar sign, or period.
+    The cmds and commands are kept in an arena, and are described by an
+    index of entries, one per cmd. A command is an offset in the arena, or
+    NO_COMMAND. Both grow as needed.
+
+    The cmds are also kept in a trie, so that a cmd in the program is
+    recognized as its characters are read, and a comment that cannot be a
+    cmd is usually rejected on its first character. The nodes are numbered,
+    with 0 being the root. accepts[node] is the cmd_nr of the cmd that ends
+    at the node, or EOF. The edges are kept in an open addressed table keyed
+    by the node and the character, which is kept at most half full. It
+    starts as a single empty slot.
+
+    All of that, and the header of comments that -comment adds to the output,
+    is kept in a context, so that a program using libjsdev can have several.
+    context is the one in use by the thread.
 */
-    return ((c >= 'a' && c <= 'z') ||
-            (c >= '0' && c <= '9') ||
-            (c >= 'A' && c <= 'Z') ||
-             c == '_' || c == '$' || c == '.');
-}
+
+#define NO_COMMAND ((size_t) -1)
+
+struct entry {
+    size_t name;
+    size_t length;
+    size_t command;
+};
+
+struct edge {
+    int from;
+    int c;
+    int to;
+};
+
+struct jsdev_ctx {
+    char*         arena;
+    size_t        arena_size;
+    size_t        arena_length;
+    struct entry* entries;
+    size_t        entries_size;
+    int           nr_cmds;
+    int*          accepts;
+    size_t        accepts_size;
+    int           nr_nodes;
+    struct edge*  edges;
+    size_t        edges_size;
+    int           nr_edges;
+    char*         header;
+    size_t        header_size;
+    size_t        header_length;
+};
+
+static struct edge no_edges[1] = {{EOF, 0, 0}};
+
+LOCAL struct jsdev_ctx* context = NULL;
+
+/*
+    The input is read in large blocks into an owned buffer. at is the cursor,
+    and limit is the end of the current block, where a 0 sentinel is stored.
+
+    Most of the input passes to the output unchanged, so characters are not
+    copied one at a time. mark is the start of the span of input that has
+    been consumed but not yet sent. The span is sent in one piece when
+    something is inserted into the output, when characters are removed from
+    it, or when the buffer is refilled. hold, when set, is the start of
+    characters that might yet be removed, so a refill must keep them.
+
+    The input is in_fd and the output is out_fd, which are stdin and stdout
+    except in a batch. If the input is a regular file, it is mapped into
+    memory instead, and the whole program is a single block. map_start is the
+    start of the mapping, which is at map_offset in the file. last_site is the
+    last place in it where a pattern could begin. After it, the output is
+    verbatim: the lexer still checks the program, but what passes is copied
+    by the kernel from the file. cant_copy, cant_splice, and cant_send note
+    the ways of copying that have failed for the output, so that they are not
+    tried again until the next one.
+
+    Short runs of output are collected in out, which holds out_size
+    characters. It is allocated the first time that a thread needs it, and
+    freed when the thread ends.
+
+    In libjsdev, the input is copied from memory, and the output is given to
+    sink, with sink_closure.
+
+    With -cache, the output is also written to cache_fd, a temporary file in
+    the cache named cache_temp, which becomes a cache entry if all goes well.
+
+    The state of the input and output, and of the lexer, is LOCAL to a thread,
+    so that the chunks of a large program can be processed in parallel. Every
+    thread starts with the same empty first block.
+*/
+
+static unsigned char first[2 + PADDING];
+
+LOCAL int            in_fd = 0;
+LOCAL int            out_fd = 1;
+LOCAL unsigned char* buffer = NULL;
+LOCAL size_t         buffer_size = 0;
+LOCAL unsigned char* at = first + 1;
+LOCAL unsigned char* limit = first + 1;
+LOCAL unsigned char* mark = first + 1;
+LOCAL unsigned char* hold = NULL;
+LOCAL int            at_eof = false;
+LOCAL int            mapped = false;
+LOCAL unsigned char* map_start;
+LOCAL size_t         map_length;
+LOCAL off_t          map_offset;
+LOCAL int            verbatim = false;
+LOCAL unsigned char* last_site = NULL;
+LOCAL int            cant_copy = false;
+LOCAL int            cant_splice = false;
+LOCAL int            cant_send = false;
+
+LOCAL unsigned char* out = NULL;
+LOCAL size_t         out_size = 0;
+LOCAL size_t         out_length = 0;
+LOCAL jsdev_out      sink = NULL;
+LOCAL void*          sink_closure = NULL;
+LOCAL int            cache_fd = -1;
+LOCAL char           cache_temp[4096];
+
+/*
+    A large mapped program can be processed in parallel by dividing it into
+    chunks. The state at the start of a chunk is not known until the chunk
+    before it has been lexed, so each chunk is lexed in parallel from each of
+    the guesses, the states that a chunk is likely to start in. The first
+    guess is the primary, which is code, and its output is kept. The other
+    runs keep only the state that they end in, and stop early if they come to
+    the same state as the primary at the same place, since from there they
+    must agree.
+
+    The runs are stitched together in order as they finish, the end of each
+    chunk selecting the run of the next. A chunk whose primary guessed wrong
+    is run again from its real start. If the real start was not among the
+    guesses, then the stitching waits for that. A chunk is written as soon as
+    it and the chunks before it are ready, and then its output is freed. If
+    the real chain fails anywhere, then the program is processed sequentially
+    instead, so that the error is reported exactly as before, with skip set
+    to the number of characters already written, which are not written again.
+
+    A run copies its chunk from source, a STEP_SIZE at a time. Between steps,
+    fill() calls checkpoint(). A snapshot is the state of the lexer, where
+    held is the number of characters that are held from before the cursor.
+    A run is mapped, so a long span that passes unchanged is kept as a span
+    of the input, and copied by the kernel when the chunk is written.
+*/
+
+#define MIN_CHUNK_SIZE 4194304
+#define STEP_SIZE      65536
+#define NR_GUESSES     14
+
+enum result {
+    RUNNING,
+    SUSPENDED,      /* at the end of the chunk */
+    DONE,           /* at the end of the input */
+    FAILED,
+    CONVERGED       /* with the primary, so it ends the same way */
+};
+
+struct snapshot {
+    int    state;
+    int    back;
+    int    code_left;
+    int    left;
+    int    paren;
+    int    node;
+    int    cmd_nr;
+    size_t held;
+};
+
+struct run {
+    struct snapshot start;
+    struct snapshot end;
+    int             result;
+};
+
+struct span {
+    size_t         at;
+    unsigned char* from;
+    size_t         length;
+};
+
+struct chunk {
+    unsigned char*   from;
+    unsigned char*   to;
+    int              last;
+    struct run       runs[NR_GUESSES];
+    int              nr_runs;
+    struct run       real;
+    struct snapshot* checkpoints;
+    size_t           checkpoints_size;
+    size_t           nr_checkpoints;
+    unsigned char*   output;
+    size_t           output_size;
+    size_t           output_length;
+    struct span*     spans;
+    size_t           spans_size;
+    size_t           nr_spans;
+    int              guessed;
+    int              ready;
+};
+
+LOCAL struct chunk*   chunk = NULL;
+LOCAL struct run*     run = NULL;
+LOCAL int             keeping = false;
+LOCAL size_t          nr_steps = 0;
+LOCAL unsigned char*  source = NULL;
+LOCAL unsigned char*  source_end = NULL;
+LOCAL size_t          skip = 0;
+LOCAL jmp_buf         escape;
+
+/*
+    A stream of libjsdev is lexed the same way, a piece at a time. When fill()
+    finds that the piece is used up, the run is suspended: the lexer state
+    and the held characters are kept in the stream, along with what is needed
+    to count lines, and the feed returns. The next feed begins again from
+    there, so every place where the lexer can wait for a character, including
+    a peek, is a place where a stream can wait for a piece.
+*/
+
+struct jsdev_stream {
+    struct jsdev_ctx* ctx;
+    jsdev_out         out;
+    void*             closure;
+    struct snapshot   resume;
+    unsigned char*    held;
+    size_t            held_size;
+    size_t            consumed;
+    int               lines;
+    int               after_cr;
+    size_t            opening;
+    int               opening_line;
+    int               twice;
+    int               word;
+    int               started;
+    int               ended;
+    int               running;
+    struct jsdev_error problem;
+};
+
+LOCAL struct jsdev_stream* stream = NULL;
+LOCAL int             finishing = false;
+
+/*
+    When failure is set, a failure is described in it and escapes, instead of
+    exiting. That is how libjsdev returns its errors.
+*/
+
+LOCAL struct jsdev_error* failure = NULL;
+
+/*
+    When the program comes from a pipe, reading, lexing, and writing can
+    overlap in a pipeline of three threads. The reader reads blocks from stdin.
+    The lexer, which is the main thread, copies them in fill(), and copies its
+    output into other blocks in drain(). The writer writes those to stdout.
+
+    Each pair of threads passes blocks through a ring. A ring has only one
+    producer and one consumer, so it needs no lock. Full blocks go forward and
+    empty blocks come back, and there are NR_BLOCKS in each direction, so a
+    ring is never full, and a stage that gets ahead of the others waits for
+    them. The time that each stage spends waiting is its stall.
+
+    A stage that waits spins for a little while, in case the block is about to
+    come, and then sleeps on the ring's condition until the other stage wakes
+    it. The other stage only takes the lock if a stage is sleeping.
+*/
+
+#define NR_BLOCKS      4
+#define RING_SIZE      8
+#define NR_SPINS       200
+
+struct block {
+    ssize_t       length;
+    unsigned char data[BLOCK_SIZE];
+};
+
+struct ring {
+    struct block*   slots[RING_SIZE];
+    size_t          head;
+    char            gap[64];
+    size_t          tail;
+    int             sleeping;
+    pthread_mutex_t lock;
+    pthread_cond_t  wake;
+};
+
+static int           pipelined = false;
+static int           write_failed = false;
+static struct ring   full_input;
+static struct ring   empty_input;
+static struct ring   full_output;
+static struct ring   empty_output;
+static struct block* current = NULL;
+static pthread_t     writer;
+static double        reader_stall = 0;
+static double        input_stall = 0;
+static double        output_stall = 0;
+static double        writer_stall = 0;
+
+static void pass();
+static void flush();
+static void checkpoint();
+static void suspend();
+static void collect(struct iovec* v, int n);
+static void refer(unsigned char* p, size_t length);
+static void deliver(struct iovec* v, int n);
+static ssize_t receive(unsigned char* p);
+static void finish();
+static ssize_t uring_receive(unsigned char* p);
+static void uring_deliver(struct iovec* v, int n);
+static void uring_finish();
+
+/*
+    With -uring, a program that comes from a pipe is read and written through
+    an io_uring. The next block of input is read into a registered buffer
+    while the lexer works on the last one, and fill() copies it out and starts
+    the next read. drain() copies the output into one of two registered
+    buffers, and a full one is written while the lexer fills the other. A
+    write must be finished before the next one starts, so that they stay in
+    order. The reads and writes are at the current position of stdin and
+    stdout, which needs IORING_FEAT_RW_CUR_POS. If the ring can't be set up,
+    read and write are used. libjsdev does no reading or writing, so it leaves
+    the ring out.
+
+    The files of a batch do not go through the ring. They are regular files,
+    so each one is mapped instead of read, and its unchanged spans are copied
+    by the kernel. The ring would only add the copies that mapping avoids.
+*/
+
+#if defined(__linux__) && defined(__NR_io_uring_setup) && \
+        !defined(JSDEV_LIBRARY)
+#define URING
+
+#define URING_READ     1
+#define URING_WRITE    2
+
+struct uring {
+    int                  fd;
+    unsigned*            sq_tail;
+    unsigned*            sq_mask;
+    unsigned*            sq_array;
+    unsigned*            cq_head;
+    unsigned*            cq_tail;
+    unsigned*            cq_mask;
+    struct io_uring_sqe* sqes;
+    struct io_uring_cqe* cqes;
+    unsigned char*       buffers[3];
+};
+
+static struct uring ring;
+static int          reading_pending = false;
+static ssize_t      read_result = 0;
+static int          writing_pending = false;
+static unsigned     filling = 1;
+static unsigned     writing = 2;
+static size_t       write_start = 0;
+static size_t       write_length = 0;
+static size_t       filled = 0;
+#endif
+
+static int          uring_on = false;
+
+
+/*
+    The scanners find the next character that needs attention, skipping
+    whole runs of characters that simply pass through. They may look at up
+    to PADDING characters past the sentinel, so every block has that much
+    room after it. The fastest scanner that the machine supports is selected
+    by select_scanners(). The portable one looks at 8 characters at a time.
+*/
+
+#define ONES        0x0101010101010101ULL
+#define HIGHS       0x8080808080808080ULL
+#define has_zero(x) (((x) - ONES) & ~(x) & HIGHS)
+#define has_byte(x, c) has_zero((x) ^ (ONES * (c)))
+#define has_visible(x) ((((x) + ONES * (127 - ' ')) | (x)) & HIGHS)
 
 
 static int
-emit(int c)
+is_significant(int c)
 {
 /*
-    Send a character to stdout.
+    Return true if the character can start something in the program text:
+    a string, a slash, or the sentinel.
 */
-    if (c > 0 && fputc(c, stdout) == EOF) {
-        error("write error.");
-    }
-    return c;
+    return (c == '\'' || c == '"' || c == '`' || c == '/' || c == 0);
 }
 
 
-static void
-emits(char* s)
+static unsigned char*
+skip_code_swar(unsigned char* p, int* left)
 {
-/*
-    Send a string to stdout.
-*/
-    if (fputs(s, stdout) == EOF) {
-        error("write error.");
+    uint64_t x;
+    int i;
+    for (;;) {
+        memcpy(&x, p, 8);
+        if (has_zero(x) | has_byte(x, '\'') | has_byte(x, '"') |
+                has_byte(x, '`') | has_byte(x, '/')) {
+            break;
+        }
+        if (has_visible(x)) {
+            for (i = 7; p[i] <= ' '; i -= 1) {
+            }
+            *left = p[i];
+        }
+        p += 8;
+    }
+    while (!is_significant(*p)) {
+        if (*p > ' ') {
+            *left = *p;
+        }
+        p += 1;
     }
+    return p;
 }
 
 
-static int
-peek()
+/*
+    A set is a small collection of up to 8 characters, always including the
+    sentinel, held as a pair of nibble tables. A character is in the set if
+    the entries for its low and high nibbles share a bit. Each member gets
+    its own bit, so there are no false matches.
+*/
+
+struct set {
+    unsigned char low[16];
+    unsigned char high[16];
+    unsigned char chars[8];
+    int           nr_chars;
+};
+
+static struct set string_set[2][3];
+static struct set regexp_set[2];
+static struct set class_set[2];
+static struct set line_set;
+
+
+static void
+add_to_set(struct set* set, int c)
 {
-    return preview = preview ? preview : fgetc(stdin);
+    int bit = set->nr_chars;
+    set->low[c & 15] |= 1 << bit;
+    set->high[c >> 4] |= 1 << bit;
+    set->chars[bit] = c;
+    set->nr_chars = bit + 1;
 }
 
 
-static int
-get(int echo)
+static void
+make_set(struct set* set, char* chars, int in_comment)
 {
 /*
-    Return the next character from the input. If the echo argument is
-    true, then the character will also be emitted.
+    Make a set of the chars and the sentinel. In a comment, a star must also
+    be looked at, since it might be closing the comment.
 */
-    int c;
-    if (preview) {
-        c = preview;
-        preview = 0;
-    } else {
-        c = fgetc(stdin);
+    memset(set, 0, sizeof(struct set));
+    add_to_set(set, 0);
+    while (*chars) {
+        add_to_set(set, (unsigned char) *chars);
+        chars += 1;
     }
-    if (c <= 0) {
-        return EOF;
-    } else if (c == '\r') {
-        cr = true;
-        line_nr += 1;
-    } else {
-        if (c == '\n' && !cr) {
-            line_nr += 1;
-        } 
-        cr = false;
+    if (in_comment) {
+        add_to_set(set, '*');
     }
-    if (echo) {
-        emit(c);
-    }
-    return c;
 }
 
 
-static void
-unget(int c)
+static int
+in_set(struct set* set, int c)
 {
-    preview = c;
+    return (set->low[c & 15] & set->high[c >> 4]) != 0;
 }
 
 
-static void
-string(int quote, int in_comment)
+static unsigned char*
+skip_to_swar(unsigned char* p, struct set* set)
 {
-    int c, was = line_nr;
+    uint64_t x, found;
+    int i;
     for (;;) {
-        c = get(true);
-        if (c == quote) {
-            return;
+        memcpy(&x, p, 8);
+        found = 0;
+        for (i = 0; i < set->nr_chars; i += 1) {
+            found |= has_byte(x, set->chars[i]);
         }
-        if (c == '\\') {
-            c = get(true);
-        }
-        if (in_comment && c == '*' && peek() == '/') {
-            error("unexpected close comment in string.");
+        if (found) {
+            break;
         }
-        if (c == EOF) {
-            line_nr = was;
-            error("unterminated string literal.");
+        p += 8;
+    }
+    while (!in_set(set, *p)) {
+        p += 1;
+    }
+    return p;
+}
+
+
+static unsigned char*
+skip_comment_swar(unsigned char* p)
+{
+/*
+    Find the next slash star or star slash in a comment. The scanners also
+    stop at the sentinel, and at a slash or star just before it, since the
+    rest of the pair may be in the next block.
+*/
+    uint64_t x;
+    for (;;) {
+        memcpy(&x, p, 8);
+        if (has_zero(x) | has_byte(x, '/') | has_byte(x, '*')) {
+            while (*p != 0 && *p != '/' && *p != '*') {
+                p += 1;
+            }
+            if (*p == 0 || p[1] == 0 || (p[0] == '/' && p[1] == '*') ||
+                    (p[0] == '*' && p[1] == '/')) {
+                return p;
+            }
+            p += 1;
+        } else {
+            p += 8;
         }
     }
 }
 
 
 static int
-pre_regexp(int left)
+count_lines_plain(unsigned char* p, unsigned char* end, int* cr)
 {
-    return (left == '(' || left == ',' || left == '=' ||
-            left == ':' || left == '[' || left == '!' ||
-            left == '&' || left == '|' || left == '?' ||
-            left == '{' || left == '}' || left == ';');
+/*
+    Return the number of line breaks from p to end. A line break is a CR, an
+    LF, or a CR LF pair. cr tells if the character before p was a CR, and is
+    updated for the character before end.
+*/
+    int n = 0;
+    while (p < end) {
+        if (*p == '\r') {
+            n += 1;
+            *cr = true;
+        } else {
+            if (*p == '\n' && !*cr) {
+                n += 1;
+            }
+            *cr = false;
+        }
+        p += 1;
+    }
+    return n;
 }
 
 
-static void
-regexp(int in_comment)
+#if defined(__GNUC__) && defined(__x86_64__)
+
+#include <immintrin.h>
+
+/*
+    The vector scanners compare a block against each significant character.
+    Visible characters are those above space, found with an unsigned max.
+*/
+
+static unsigned char*
+skip_code_sse2(unsigned char* p, int* left)
 {
-    int c, was = line_nr;
+    __m128i v, s;
+    const __m128i space = _mm_set1_epi8(' ' + 1);
+    unsigned int stops, seen;
     for (;;) {
-        c = get(true);
-        if (c == '[') {
-            for (;;) {
-                c = get(true);
-                if (c == ']') {
-                    break;
-                }
-                if (c == '\\') {
-                    c = get(true);
-                }
-                if (in_comment && c == '*' && peek() == '/') {
-                    error("unexpected close comment in regexp.");
-                }
-                if (c == EOF) {
-                    error("unterminated set in Regular Expression literal.");
-                }
+        v = _mm_loadu_si128((const __m128i*) p);
+        s = _mm_or_si128(
+            _mm_or_si128(
+                _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('\'')),
+                             _mm_cmpeq_epi8(v, _mm_set1_epi8('"'))),
+                _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('`')),
+                             _mm_cmpeq_epi8(v, _mm_set1_epi8('/')))),
+            _mm_cmpeq_epi8(v, _mm_setzero_si128()));
+        stops = (unsigned int) _mm_movemask_epi8(s);
+        seen = (unsigned int) _mm_movemask_epi8(
+            _mm_cmpeq_epi8(_mm_max_epu8(v, space), v));
+        if (stops) {
+            seen &= (stops & -stops) - 1;
+            if (seen) {
+                *left = p[31 - __builtin_clz(seen)];
             }
-        } else if (c == '/') {
-            if (in_comment && (peek() == '/' || peek() == '*')) {
-                error("unexpected comment.");
-            }
-            return;
-        } else if (c =='\\') {
-            c = get(true);
+            return p + __builtin_ctz(stops);
         }
-        if (in_comment && c == '*' && peek() == '/') {
-            error("unexpected comment.");
-        }
-        if (c == EOF) {
-            line_nr = was;
-            error("unterminated regexp literal.");
+        if (seen) {
+            *left = p[31 - __builtin_clz(seen)];
         }
+        p += 16;
     }
 }
 
 
-static void
-condition()
+__attribute__((target("avx2")))
+static unsigned char*
+skip_code_avx2(unsigned char* p, int* left)
 {
-    int c, left, paren = 0;
+    __m256i v, s;
+    const __m256i space = _mm256_set1_epi8(' ' + 1);
+    unsigned int stops, seen;
     for (;;) {
-        c = get(true);
-        if (c == '(' || c == '{' || c == '[') {
-            paren += 1;
-        } else if (c == ')' || c == '}' || c == ']') {
-            paren -= 1;
-            if (paren == 0) {
-                return;
-            }
-        } else if (c == EOF) {
-            error("Unterminated condition.");
-        } else if (c == '\'' || c == '"' || c == '`') {
-            string(c, true);
-        } else if (c == '/') {
-            if (peek() == '/' || peek() == '*') {
-                error("unexpected comment.");
-            }
-            if (pre_regexp(left)) {
-                regexp(true);
+        v = _mm256_loadu_si256((const __m256i*) p);
+        s = _mm256_or_si256(
+            _mm256_or_si256(
+                _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('\'')),
+                                _mm256_cmpeq_epi8(v, _mm256_set1_epi8('"'))),
+                _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('`')),
+                                _mm256_cmpeq_epi8(v, _mm256_set1_epi8('/')))),
+            _mm256_cmpeq_epi8(v, _mm256_setzero_si256()));
+        stops = (unsigned int) _mm256_movemask_epi8(s);
+        seen = (unsigned int) _mm256_movemask_epi8(
+            _mm256_cmpeq_epi8(_mm256_max_epu8(v, space), v));
+        if (stops) {
+            seen &= (stops & -stops) - 1;
+            if (seen) {
+                *left = p[31 - __builtin_clz(seen)];
             }
-        } else if (c == '*' && peek() == '/') {
-            error("unclosed condition.");
+            return p + __builtin_ctz(stops);
         }
-        if (c > ' ') {
-            left = c;
+        if (seen) {
+            *left = p[31 - __builtin_clz(seen)];
         }
+        p += 32;
     }
 }
 
 
-static void
-stuff()
+__attribute__((target("avx512f,avx512bw")))
+static unsigned char*
+skip_code_avx512(unsigned char* p, int* left)
 {
-    int c, left = '{', paren = 0;
+    __m512i v;
+    unsigned long long stops, seen;
     for (;;) {
-        while (peek() == '*') {
-            get(false);
-            if (peek() == '/') {
-                get(false);
-                return;
-            }
-            emit('*');
-        }
-        c = get(true);
-        if (c == EOF) {
-            error("Unterminated stuff.");
-        } else if (c == '\'' || c == '"' || c == '`') {
-            string(c, true);
-        } else if (c == '/') {
-            if (peek() == '/' || peek() == '*') {
-                error("unexpected comment.");
-            }
-            if (pre_regexp(left)) {
-                regexp(true);
+        v = _mm512_loadu_si512((const void*) p);
+        stops = _mm512_cmpeq_epi8_mask(v, _mm512_set1_epi8('\'')) |
+                _mm512_cmpeq_epi8_mask(v, _mm512_set1_epi8('"')) |
+                _mm512_cmpeq_epi8_mask(v, _mm512_set1_epi8('`')) |
+                _mm512_cmpeq_epi8_mask(v, _mm512_set1_epi8('/')) |
+                _mm512_cmpeq_epi8_mask(v, _mm512_setzero_si512());
+        seen = _mm512_cmpgt_epu8_mask(v, _mm512_set1_epi8(' '));
+        if (stops) {
+            seen &= (stops & -stops) - 1;
+            if (seen) {
+                *left = p[63 - __builtin_clzll(seen)];
             }
+            return p + __builtin_ctzll(stops);
         }
-        if (c > ' ') {
-            left = c;
+        if (seen) {
+            *left = p[63 - __builtin_clzll(seen)];
         }
+        p += 64;
     }
 }
 
 
-static void
-expand(int cmd_nr)
-{
-    int c;
-    int cond = false;
+/*
+    The set scanners look up both nibbles of every character in a block with
+    a shuffle, and stop at the first character whose entries share a bit.
+*/
 
-    c = peek();
-    if (c == '(') {
-        emits("if ");
-        condition();
-    }
-    emit('{');
-    if (commands[cmd_nr][0]) {
-        emits(commands[cmd_nr]);
-        emit('(');
-        stuff();
-        emit(')');
-    } else {
-        stuff();
+__attribute__((target("ssse3")))
+static unsigned char*
+skip_to_ssse3(unsigned char* p, struct set* set)
+{
+    const __m128i low = _mm_loadu_si128((const __m128i*) set->low);
+    const __m128i high = _mm_loadu_si128((const __m128i*) set->high);
+    const __m128i nibble = _mm_set1_epi8(15);
+    __m128i v, m;
+    unsigned int stops;
+    for (;;) {
+        v = _mm_loadu_si128((const __m128i*) p);
+        m = _mm_and_si128(
+            _mm_shuffle_epi8(low, _mm_and_si128(v, nibble)),
+            _mm_shuffle_epi8(high, _mm_and_si128(_mm_srli_epi16(v, 4), nibble)));
+        stops = 0xFFFF ^ (unsigned int) _mm_movemask_epi8(
+            _mm_cmpeq_epi8(m, _mm_setzero_si128()));
+        if (stops) {
+            return p + __builtin_ctz(stops);
+        }
+        p += 16;
     }
-    emits(";}");
 }
 
 
-static int
-match()
+__attribute__((target("avx2")))
+static unsigned char*
+skip_to_avx2(unsigned char* p, struct set* set)
 {
-    int cmd_nr;
-
-    for (cmd_nr = 0; cmd_nr < nr_cmds; cmd_nr += 1) {
-        if (strcmp(cmd, cmds[cmd_nr]) == 0) {
-            return cmd_nr;
+    const __m256i low = _mm256_broadcastsi128_si256(
+        _mm_loadu_si128((const __m128i*) set->low));
+    const __m256i high = _mm256_broadcastsi128_si256(
+        _mm_loadu_si128((const __m128i*) set->high));
+    const __m256i nibble = _mm256_set1_epi8(15);
+    __m256i v, m;
+    unsigned int stops;
+    for (;;) {
+        v = _mm256_loadu_si256((const __m256i*) p);
+        m = _mm256_and_si256(
+            _mm256_shuffle_epi8(low, _mm256_and_si256(v, nibble)),
+            _mm256_shuffle_epi8(high,
+                _mm256_and_si256(_mm256_srli_epi16(v, 4), nibble)));
+        stops = ~(unsigned int) _mm256_movemask_epi8(
+            _mm256_cmpeq_epi8(m, _mm256_setzero_si256()));
+        if (stops) {
+            return p + __builtin_ctz(stops);
         }
+        p += 32;
     }
-    return EOF;
 }
 
 
-static void
-process()
+__attribute__((target("avx512f,avx512bw")))
+static unsigned char*
+skip_to_avx512(unsigned char* p, struct set* set)
 {
-/*
-    Loop through the program text, looking for patterns.
-*/
-    int c, i, left = 0;
-    line_nr = 1;
-    c = get(false);
+    const __m512i low = _mm512_broadcast_i32x4(
+        _mm_loadu_si128((const __m128i*) set->low));
+    const __m512i high = _mm512_broadcast_i32x4(
+        _mm_loadu_si128((const __m128i*) set->high));
+    const __m512i nibble = _mm512_set1_epi8(15);
+    __m512i v, m;
+    unsigned long long stops;
     for (;;) {
-        if (c == EOF) {
-            break;
-        } else if (c == '\'' || c == '"' || c == '`') {
-            emit(c);
-            string(c, false);
-            c = 0;
-/*
-    The most complicated case is the slash. It can mean division or a regexp
-    literal or a line comment or a block comment. A block comment can also be
-    a pattern to be expanded.
-*/
-        } else if (c == '/') {
-/*
-    A slash slash comment skips to the end of the file.
-*/
-            if (peek() == '/') {
-                emit('/');
-                for (;;) {
-                    c = get(true);
-                    if (c == '\n' || c == '\r' || c == EOF) {
-                        break;
-                    }
-                }
-                c = get(false);
-/*
-    The first component of a slash star comment might be the cmd.
-*/
-            } else {
-                if (peek() == '*') {
-                    get(false);
-                    for (i = 0; i < MAX_CMD_LENGTH; i += 1) {
-                        c = get(false);
-                        if (!is_alphanum(c)) {
-                            break;
-                        }
-                        cmd[i] = c;
-                    }
-                    cmd[i] = 0;
-                    unget(c);
-/*
-    Did the cmd matches something?.
-*/
-                    i = i == 0 ? -1 : match();
-                    if (i >= 0) {
-                        expand(i);
-                        c = get(false);
-                    } else {
-/*
-    If the cmd didn't match, then echo the comment.
-*/
-                        emits("/*");
-                        emits(cmd);
-                        for (;;) {
-                            if (c == EOF) {
-                                error("unterminated comment.");
-                            }
-                            if (c == '/') {
-                                c = get(true);
-                                if (c == '*') {
-                                    error("nested comment.");
-                                }
-                            } else if (c == '*') {
-                                c = get(true);
-                                if (c == '/') {
-                                    break;
-                                }
-                            } else {
-                                c = get(true);
-                            }
-                        }
-                        c = get(false);
-                    }
-                } else {
-                    emit('/');
-                    if (pre_regexp(left)) {
-/*
-    We are looking at a single slash. Is it a division operator, or is it the
-    start of a regexp literal? If is not possible to tell for sure without doing
-    a complete parse of the program, and we are not going to do that. Instead,
-    we are adopting the convention that a regexp literal must have one of a
-    small set of characters to its left.
-*/
-                        regexp(false);
-                    } else {
-/*
-    Or maybe the slash was a division operator.
-*/
-                    }
-                    left = '/';
-                    c = get(false);
-                }
-            }
-        } else {
-/*
-    The character was nothing special, to just echo it.
-    If it wasn't whitespace, remember it as the character to the left of the
-    next character.
-*/
-            emit(c);
-            if (c > ' ') {
-                left = c;
-            }
-            c = get(false);
+        v = _mm512_loadu_si512((const void*) p);
+        m = _mm512_and_si512(
+            _mm512_shuffle_epi8(low, _mm512_and_si512(v, nibble)),
+            _mm512_shuffle_epi8(high,
+                _mm512_and_si512(_mm512_srli_epi16(v, 4), nibble)));
+        stops = _mm512_test_epi8_mask(m, m);
+        if (stops) {
+            return p + __builtin_ctzll(stops);
         }
+        p += 64;
     }
 }
 
 
-extern int
+/*
+    The comment scanners compare a block and the same block shifted by one,
+    to find pairs.
+*/
+
+static unsigned char*
+skip_comment_sse2(unsigned char* p)
+{
+    __m128i v0, v1, slash0, star0, zero1;
+    unsigned int stops;
+    for (;;) {
+        v0 = _mm_loadu_si128((const __m128i*) p);
+        v1 = _mm_loadu_si128((const __m128i*) (p + 1));
+        slash0 = _mm_cmpeq_epi8(v0, _mm_set1_epi8('/'));
+        star0 = _mm_cmpeq_epi8(v0, _mm_set1_epi8('*'));
+        zero1 = _mm_cmpeq_epi8(v1, _mm_setzero_si128());
+        stops = (unsigned int) _mm_movemask_epi8(_mm_or_si128(
+            _mm_or_si128(
+                _mm_and_si128(slash0, _mm_cmpeq_epi8(v1, _mm_set1_epi8('*'))),
+                _mm_and_si128(star0, _mm_cmpeq_epi8(v1, _mm_set1_epi8('/')))),
+            _mm_or_si128(
+                _mm_cmpeq_epi8(v0, _mm_setzero_si128()),
+                _mm_and_si128(_mm_or_si128(slash0, star0), zero1))));
+        if (stops) {
+            return p + __builtin_ctz(stops);
+        }
+        p += 16;
+    }
+}
+
+
+__attribute__((target("avx2")))
+static unsigned char*
+skip_comment_avx2(unsigned char* p)
+{
+    __m256i v0, v1, slash0, star0, zero1;
+    unsigned int stops;
+    for (;;) {
+        v0 = _mm256_loadu_si256((const __m256i*) p);
+        v1 = _mm256_loadu_si256((const __m256i*) (p + 1));
+        slash0 = _mm256_cmpeq_epi8(v0, _mm256_set1_epi8('/'));
+        star0 = _mm256_cmpeq_epi8(v0, _mm256_set1_epi8('*'));
+        zero1 = _mm256_cmpeq_epi8(v1, _mm256_setzero_si256());
+        stops = (unsigned int) _mm256_movemask_epi8(_mm256_or_si256(
+            _mm256_or_si256(
+                _mm256_and_si256(slash0,
+                    _mm256_cmpeq_epi8(v1, _mm256_set1_epi8('*'))),
+                _mm256_and_si256(star0,
+                    _mm256_cmpeq_epi8(v1, _mm256_set1_epi8('/')))),
+            _mm256_or_si256(
+                _mm256_cmpeq_epi8(v0, _mm256_setzero_si256()),
+                _mm256_and_si256(_mm256_or_si256(slash0, star0), zero1))));
+        if (stops) {
+            return p + __builtin_ctz(stops);
+        }
+        p += 32;
+    }
+}
+
+
+__attribute__((target("avx512f,avx512bw")))
+static unsigned char*
+skip_comment_avx512(unsigned char* p)
+{
+    __m512i v0, v1;
+    unsigned long long slash0, star0, stops;
+    for (;;) {
+        v0 = _mm512_loadu_si512((const void*) p);
+        v1 = _mm512_loadu_si512((const void*) (p + 1));
+        slash0 = _mm512_cmpeq_epi8_mask(v0, _mm512_set1_epi8('/'));
+        star0 = _mm512_cmpeq_epi8_mask(v0, _mm512_set1_epi8('*'));
+        stops = (slash0 & _mm512_cmpeq_epi8_mask(v1, _mm512_set1_epi8('*'))) |
+                (star0 & _mm512_cmpeq_epi8_mask(v1, _mm512_set1_epi8('/'))) |
+                _mm512_cmpeq_epi8_mask(v0, _mm512_setzero_si512()) |
+                ((slash0 | star0) &
+                 _mm512_cmpeq_epi8_mask(v1, _mm512_setzero_si512()));
+        if (stops) {
+            return p + __builtin_ctzll(stops);
+        }
+        p += 64;
+    }
+}
+
+/*
+    The line counters count the CRs in a block, and the LFs that do not
+    follow a CR, with a population count of the compare masks.
+*/
+
+static int
+count_lines_sse2(unsigned char* p, unsigned char* end, int* cr)
+{
+    __m128i v;
+    unsigned int crs, lfs, carry = *cr ? 1 : 0;
+    int n = 0;
+    while (end - p >= 16) {
+        v = _mm_loadu_si128((const __m128i*) p);
+        crs = (unsigned int) _mm_movemask_epi8(
+            _mm_cmpeq_epi8(v, _mm_set1_epi8('\r')));
+        lfs = (unsigned int) _mm_movemask_epi8(
+            _mm_cmpeq_epi8(v, _mm_set1_epi8('\n')));
+        n += __builtin_popcount(crs) +
+             __builtin_popcount(lfs & ~((crs << 1) | carry));
+        carry = crs >> 15;
+        p += 16;
+    }
+    *cr = carry;
+    return n + count_lines_plain(p, end, cr);
+}
+
+
+__attribute__((target("avx2,popcnt")))
+static int
+count_lines_avx2(unsigned char* p, unsigned char* end, int* cr)
+{
+    __m256i v;
+    unsigned int crs, lfs, carry = *cr ? 1 : 0;
+    int n = 0;
+    while (end - p >= 32) {
+        v = _mm256_loadu_si256((const __m256i*) p);
+        crs = (unsigned int) _mm256_movemask_epi8(
+            _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\r')));
+        lfs = (unsigned int) _mm256_movemask_epi8(
+            _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\n')));
+        n += __builtin_popcount(crs) +
+             __builtin_popcount(lfs & ~((crs << 1) | carry));
+        carry = crs >> 31;
+        p += 32;
+    }
+    *cr = carry;
+    return n + count_lines_plain(p, end, cr);
+}
+
+
+__attribute__((target("avx512f,avx512bw,popcnt")))
+static int
+count_lines_avx512(unsigned char* p, unsigned char* end, int* cr)
+{
+    __m512i v;
+    unsigned long long crs, lfs, carry = *cr ? 1 : 0;
+    int n = 0;
+    while (end - p >= 64) {
+        v = _mm512_loadu_si512((const void*) p);
+        crs = _mm512_cmpeq_epi8_mask(v, _mm512_set1_epi8('\r'));
+        lfs = _mm512_cmpeq_epi8_mask(v, _mm512_set1_epi8('\n'));
+        n += __builtin_popcountll(crs) +
+             __builtin_popcountll(lfs & ~((crs << 1) | carry));
+        carry = crs >> 63;
+        p += 64;
+    }
+    *cr = (int) carry;
+    return n + count_lines_plain(p, end, cr);
+}
+
+#endif
+
+
+static unsigned char* (*skip_code)(unsigned char* p, int* left) =
+    skip_code_swar;
+static unsigned char* (*skip_to)(unsigned char* p, struct set* set) =
+    skip_to_swar;
+static unsigned char* (*skip_comment)(unsigned char* p) = skip_comment_swar;
+static int (*count_lines)(unsigned char* p, unsigned char* end, int* cr) =
+    count_lines_plain;
+
+
+static void
+select_scanners()
+{
+    int in_comment;
+    for (in_comment = false; in_comment <= true; in_comment += 1) {
+        make_set(&string_set[in_comment][0], "'\\", in_comment);
+        make_set(&string_set[in_comment][1], "\"\\", in_comment);
+        make_set(&string_set[in_comment][2], "`\\", in_comment);
+        make_set(&regexp_set[in_comment], "[/\\", in_comment);
+        make_set(&class_set[in_comment], "]\\", in_comment);
+    }
+    make_set(&line_set, "\n\r", false);
+#if defined(__GNUC__) && defined(__x86_64__)
+    __builtin_cpu_init();
+    skip_code = skip_code_sse2;
+    skip_comment = skip_comment_sse2;
+    count_lines = count_lines_sse2;
+    if (__builtin_cpu_supports("ssse3")) {
+        skip_to = skip_to_ssse3;
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        skip_code = skip_code_avx2;
+        skip_to = skip_to_avx2;
+        skip_comment = skip_comment_avx2;
+        count_lines = count_lines_avx2;
+    }
+    if (__builtin_cpu_supports("avx512bw")) {
+        skip_code = skip_code_avx512;
+        skip_to = skip_to_avx512;
+        skip_comment = skip_comment_avx512;
+        count_lines = count_lines_avx512;
+    }
+#endif
+}
+
+
+/*
+    Line numbers are only needed for error messages, so line breaks are not
+    counted as characters are gotten. start is the first character in the
+    buffer that has not been counted, and consumed is its offset in the input.
+    When a block is discarded, the line breaks in it are added to lines.
+    opening is the offset of the string or regexp literal being scanned. Its
+    line is noted if its block is discarded, in case it is unterminated.
+    twice is the number of line breaks that have always been counted twice:
+    the character that ends the first word of a slash star comment is gotten
+    again, and if it is a line break, it is counted again. Only the first
+    WORD_LENGTH characters of the word were read, so a line break after a
+    longer word was not. Adding them keeps the line numbers the same as they
+    have always been.
+*/
+
+#define WORD_LENGTH 80
+
+LOCAL unsigned char* start = first + 1;
+LOCAL size_t         consumed = 0;
+LOCAL int            lines = 0;
+LOCAL int            after_cr = false;
+LOCAL size_t         opening = 0;
+LOCAL int            opening_line = 0;
+LOCAL int            twice = 0;
+LOCAL int            reading = false;
+
+
+static size_t
+position()
+{
+    return consumed + (size_t) (at - start);
+}
+
+
+static int
+line_at(size_t offset)
+{
+/*
+    Return the line number of an offset in the input. An offset that has been
+    discarded can only be the opening.
+*/
+    int cr = after_cr;
+    if (offset < consumed) {
+        return opening_line + twice;
+    }
+    return 1 + lines + twice
+        + count_lines(start, start + (offset - consumed), &cr);
+}
+
+
+static void
+count_to(unsigned char* keep)
+{
+/*
+    Count the line breaks before keep, which is about to be discarded.
+*/
+    unsigned char* p;
+    if (keep <= start) {
+        return;
+    }
+    if (opening >= consumed && opening < consumed + (size_t) (keep - start)) {
+        p = start + (opening - consumed);
+        lines += count_lines(start, p, &after_cr);
+        consumed += (size_t) (p - start);
+        start = p;
+        opening_line = 1 + lines;
+    }
+    lines += count_lines(start, keep, &after_cr);
+    consumed += (size_t) (keep - start);
+    start = keep;
+}
+
+
+static void
+fail_at(int status, size_t offset, char* message)
+{
+/*
+    In a chunk, a failure fails the run. When failure is set, the failure is
+    described there, and escapes. A syntax error first gives the output so far
+    to the sink, as the program would. Otherwise the failure is reported on
+    stderr after the output so far is written, and the program exits.
+*/
+    static int failing = false;
+    if (chunk != NULL) {
+        run->result = FAILED;
+        longjmp(escape, 1);
+    }
+    if (failure != NULL) {
+        failure->status = status;
+        failure->line = reading ? line_at(offset) : 0;
+        failure->offset = offset;
+        failure->message = message;
+        if (status == JSDEV_SYNTAX_ERROR && sink != NULL) {
+            pass();
+            flush();
+        }
+        longjmp(escape, 1);
+    }
+    if (!failing) {
+        failing = true;
+        pass();
+        flush();
+        if (pipelined) {
+            finish();
+        }
+        if (uring_on) {
+            uring_finish();
+        }
+    }
+    fputs("JSDev: ", stderr);
+    if (reading) {
+        fprintf(stderr, "%d. ", line_at(offset));
+    } else {
+        fputs("bad command line ", stderr);
+    }
+    fputs(message, stderr);
+    fputs("\r\n", stderr);
+    if (cache_fd >= 0) {
+        unlink(cache_temp);
+    }
+    exit(1);
+}
+
+
+static void
+fail(int status, char* message)
+{
+    fail_at(status, position(), message);
+}
+
+
+static void
+error_at(size_t offset, char* message)
+{
+    fail_at(JSDEV_SYNTAX_ERROR, offset, message);
+}
+
+
+static void
+error(char* message)
+{
+    error_at(position(), message);
+}
+
+
+static int
+is_alphanum(int c)
+{
+/*
+    Return true if the character is a letter, digit, underscore,
+    dollar sign, or period.
+*/
+    return is(c, CMD_CHAR);
+}
+
+
+static void*
+enlarge(void* p, size_t* size, size_t need)
+{
+/*
+    Return a block of at least need bytes that begins with the contents of p,
+    whose size is *size. The size is at least doubled when it changes.
+*/
+    size_t n = *size;
+    if (need <= n) {
+        return p;
+    }
+    n = n * 2 > need ? n * 2 : need;
+    p = realloc(p, n);
+    if (p == NULL) {
+        fail(JSDEV_NO_MEMORY, "out of memory.");
+    }
+    *size = n;
+    return p;
+}
+
+
+static void
+keep(struct iovec* v, int n)
+{
+/*
+    Write the vectors to the cache entry that is being made. If that fails,
+    the entry is dropped.
+*/
+    int i;
+    size_t done;
+    ssize_t written;
+    for (i = 0; i < n; i += 1) {
+        for (done = 0; done < v[i].iov_len; done += (size_t) written) {
+            written = write(cache_fd, (char*) v[i].iov_base + done,
+                    v[i].iov_len - done);
+            if (written < 0 && errno == EINTR) {
+                written = 0;
+            } else if (written <= 0) {
+                close(cache_fd);
+                unlink(cache_temp);
+                cache_fd = -1;
+                return;
+            }
+        }
+    }
+}
+
+
+static void
+drain(struct iovec* v, int n)
+{
+/*
+    Write the vectors to stdout, resuming after a short write, or give them to
+    the sink.
+*/
+    ssize_t written;
+    int i;
+    if (chunk != NULL) {
+        collect(v, n);
+        return;
+    }
+    if (sink != NULL) {
+        for (i = 0; i < n; i += 1) {
+            if (v[i].iov_len > 0 && sink(sink_closure,
+                    (const char*) v[i].iov_base, v[i].iov_len) != 0 &&
+                    failure->status == JSDEV_OK) {
+                fail(JSDEV_WRITE_ERROR, "write error.");
+            }
+        }
+        return;
+    }
+    if (pipelined) {
+        deliver(v, n);
+        return;
+    }
+    if (uring_on) {
+        uring_deliver(v, n);
+        return;
+    }
+    while (skip > 0 && n > 0) {
+        if (v->iov_len > skip) {
+            v->iov_base = (char*) v->iov_base + skip;
+            v->iov_len -= skip;
+            skip = 0;
+        } else {
+            skip -= v->iov_len;
+            v += 1;
+            n -= 1;
+        }
+    }
+    if (cache_fd >= 0) {
+        keep(v, n);
+    }
+    while (n > 0) {
+        written = writev(out_fd, v, n);
+        if (written < 0) {
+            if (errno != EINTR) {
+                fail(JSDEV_WRITE_ERROR, "write error.");
+            }
+            continue;
+        }
+        while (n > 0 && (size_t) written >= v->iov_len) {
+            written -= v->iov_len;
+            v += 1;
+            n -= 1;
+        }
+        if (n > 0) {
+            v->iov_base = (char*) v->iov_base + written;
+            v->iov_len -= written;
+        }
+    }
+}
+
+
+static pthread_key_t  out_key;
+static pthread_once_t out_key_made = PTHREAD_ONCE_INIT;
+
+
+static void
+make_out_key()
+{
+    pthread_key_create(&out_key, free);
+}
+
+
+static void
+open_out()
+{
+/*
+    Give the thread its output buffer, which is freed when the thread ends.
+*/
+    pthread_once(&out_key_made, make_out_key);
+    out = (unsigned char*) malloc(BLOCK_SIZE);
+    if (out == NULL) {
+        fail(JSDEV_NO_MEMORY, "out of memory.");
+    }
+    out_size = BLOCK_SIZE;
+    pthread_setspecific(out_key, out);
+}
+
+
+static void
+flush()
+{
+/*
+    Write the output buffer.
+*/
+    struct iovec v[1];
+    v[0].iov_base = out;
+    v[0].iov_len = out_length;
+    out_length = 0;
+    drain(v, 1);
+}
+
+
+static void
+ship(unsigned char* s, size_t length)
+{
+/*
+    Send characters to stdout. Short runs are collected in the output buffer.
+    A long run is written directly, along with the buffer, in a single call.
+*/
+    struct iovec v[2];
+    if (out_length + length >= out_size && out == NULL) {
+        open_out();
+    }
+    if (out_length + length <= out_size) {
+        memcpy(out + out_length, s, length);
+        out_length += length;
+    } else {
+        v[0].iov_base = out;
+        v[0].iov_len = out_length;
+        v[1].iov_base = s;
+        v[1].iov_len = length;
+        out_length = 0;
+        drain(v, 2);
+    }
+}
+
+
+static void
+transfer(unsigned char* p, size_t length)
+{
+/*
+    Send a span of the mapped input by having the kernel copy it from the
+    file: with copy_file_range if stdout is a file, with splice if it is a
+    pipe, or else with sendfile. A way that fails is not tried again for the
+    same output. Whatever they can't do is written from the mapping. In a
+    chunk, the span is noted, and is copied when the chunk is written.
+*/
+    struct iovec v[1];
+    size_t skipped;
+#ifdef __linux__
+    off_t offset;
+    ssize_t n;
+#endif
+    flush();
+    if (chunk != NULL) {
+        refer(p, length);
+        return;
+    }
+    skipped = skip < length ? skip : length;
+    p += skipped;
+    length -= skipped;
+    skip -= skipped;
+#ifdef __linux__
+    offset = map_offset + (p - map_start);
+#endif
+    if (cache_fd >= 0) {
+        v[0].iov_base = p;
+        v[0].iov_len = length;
+        keep(v, 1);
+    }
+#ifdef __linux__
+    while (length > 0) {
+        if (!cant_copy) {
+            n = copy_file_range(in_fd, &offset, out_fd, NULL, length, 0);
+            cant_copy = n < 0 && errno != EINTR;
+        } else if (!cant_splice) {
+            n = splice(in_fd, &offset, out_fd, NULL, length, 0);
+            cant_splice = n < 0 && errno != EINTR;
+        } else if (!cant_send) {
+            n = sendfile(out_fd, in_fd, &offset, length);
+            cant_send = n < 0 && errno != EINTR;
+        } else {
+            break;
+        }
+        if (n == 0) {
+            break;
+        }
+        if (n > 0) {
+            p += n;
+            length -= (size_t) n;
+        }
+    }
+#endif
+    v[0].iov_base = p;
+    v[0].iov_len = length;
+    drain(v, 1);
+}
+
+
+static void
+forward(unsigned char* p, size_t length)
+{
+/*
+    Send a span of the input unchanged. Once the output is verbatim, or if the
+    span is a long one in the mapping, it is copied by the kernel.
+*/
+    if (verbatim || (mapped && length >= TRANSFER_SIZE)) {
+        transfer(p, length);
+    } else {
+        ship(p, length);
+    }
+}
+
+
+static void
+pass()
+{
+/*
+    Send the span of input that has been consumed since the mark.
+*/
+    forward(mark, at - mark);
+    mark = at;
+}
+
+
+static void
+cut(unsigned char* from)
+{
+/*
+    Remove the characters between from and the cursor from the output.
+*/
+    forward(mark, from - mark);
+    mark = at;
+    hold = NULL;
+}
+
+
+static int
+emit(int c)
+{
+/*
+    Insert a character into the output.
+*/
+    pass();
+    if (out_length == out_size) {
+        if (out == NULL) {
+            open_out();
+        } else {
+            flush();
+        }
+    }
+    out[out_length] = (unsigned char) c;
+    out_length += 1;
+    return c;
+}
+
+
+static void
+emits(char* s)
+{
+/*
+    Insert a string into the output.
+*/
+    pass();
+    ship((unsigned char*) s, strlen(s));
+}
+
+
+static int
+fill()
+{
+/*
+    Read the next block of the input. The consumed span is sent first, except
+    for the part that is being held. That part, or else the last character so
+    that unget can always back up, is moved to the front of the buffer.
+    Return false if there is no more.
+*/
+    unsigned char* keep;
+    unsigned char* fresh;
+    size_t kept, at_off, mark_off, start_off, hold_off = 0;
+    ssize_t n = 0;
+
+    if (at_eof) {
+        return false;
+    }
+    if (hold) {
+        ship(mark, hold - mark);
+        mark = hold;
+    } else {
+        pass();
+    }
+    if (chunk != NULL) {
+        checkpoint();
+    } else if (stream != NULL && source == source_end && !finishing) {
+        suspend();
+    }
+    keep = mark < at ? mark : at - 1;
+    count_to(keep);
+    kept = limit - keep;
+    at_off = at - keep;
+    mark_off = mark - keep;
+    start_off = start - keep;
+    if (hold) {
+        hold_off = hold - keep;
+    }
+    if (kept + BLOCK_SIZE + 1 + PADDING > buffer_size) {
+        buffer_size = 2 * kept + BLOCK_SIZE + 1 + PADDING;
+        fresh = (unsigned char*) malloc(buffer_size);
+        if (fresh == NULL) {
+            fail(JSDEV_NO_MEMORY, "out of memory.");
+        }
+        memcpy(fresh, keep, kept);
+        free(buffer);
+        buffer = fresh;
+    } else {
+        memmove(buffer, keep, kept);
+    }
+    at = buffer + at_off;
+    mark = buffer + mark_off;
+    start = buffer + start_off;
+    if (hold) {
+        hold = buffer + hold_off;
+    }
+    if (source != NULL) {
+        n = chunk != NULL ? STEP_SIZE : BLOCK_SIZE;
+        if (source_end - source < n) {
+            n = source_end - source;
+        }
+        memcpy(at, source, n);
+        source += n;
+        at_eof = n == 0;
+    } else if (pipelined) {
+        n = receive(at);
+        at_eof = n == 0;
+    } else if (uring_on) {
+        n = uring_receive(at);
+        at_eof = n == 0;
+    } else {
+        while (!at_eof) {
+            n = read(in_fd, at, BLOCK_SIZE);
+            if (n > 0) {
+                break;
+            }
+            if (n == 0) {
+                at_eof = true;
+            } else if (errno != EINTR) {
+                fail(JSDEV_READ_ERROR, "read error.");
+            }
+        }
+    }
+    limit = at + (n > 0 ? n : 0);
+    *limit = 0;
+    return n > 0;
+}
+
+
+static void
+map_input()
+{
+/*
+    If stdin is a regular file, map the rest of it into memory. The mapping is
+    placed at the front of a reserved region that is one page longer, so that
+    there is always a 0 sentinel after the last character. Anything else, or
+    any failure, is left to fill().
+*/
+    struct stat status;
+    off_t offset, base;
+    size_t length, page = (size_t) sysconf(_SC_PAGESIZE);
+    unsigned char* region;
+
+    if (fstat(in_fd, &status) != 0 || !S_ISREG(status.st_mode)) {
+        return;
+    }
+    offset = lseek(in_fd, 0, SEEK_CUR);
+    if (offset < 0 || offset >= status.st_size) {
+        return;
+    }
+    base = offset - offset % page;
+    length = (size_t) (status.st_size - base);
+    region = (unsigned char*) mmap(NULL, length + page, PROT_READ,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (region == MAP_FAILED) {
+        return;
+    }
+    if (mmap(region, length, PROT_READ, MAP_PRIVATE | MAP_FIXED, in_fd,
+            base) == MAP_FAILED) {
+        munmap(region, length + page);
+        return;
+    }
+    madvise(region, length, MADV_SEQUENTIAL);
+    mapped = true;
+    map_start = region;
+    map_length = length + page;
+    map_offset = base;
+    at = region + (offset - base);
+    mark = at;
+    start = at;
+    limit = region + length;
+    at_eof = true;
+}
+
+
+static double
+now()
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (double) t.tv_sec + (double) t.tv_nsec / 1e9;
+}
+
+
+static void
+open_ring(struct ring* r)
+{
+    pthread_mutex_init(&r->lock, NULL);
+    pthread_cond_init(&r->wake, NULL);
+}
+
+
+static void
+put_block(struct ring* r, struct block* b)
+{
+/*
+    Add a block to a ring. There is always room.
+*/
+    size_t tail = r->tail;
+    r->slots[tail % RING_SIZE] = b;
+    __atomic_store_n(&r->tail, tail + 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&r->sleeping, __ATOMIC_SEQ_CST)) {
+        pthread_mutex_lock(&r->lock);
+        pthread_cond_signal(&r->wake);
+        pthread_mutex_unlock(&r->lock);
+    }
+}
+
+
+static struct block*
+take_block(struct ring* r, double* stall)
+{
+/*
+    Take the next block from a ring, waiting for one if it is empty. The time
+    spent waiting is added to the stall.
+*/
+    size_t head = r->head;
+    double started;
+    int spins = 0;
+    if (__atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) == head) {
+        started = now();
+        while (__atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) == head &&
+                spins < NR_SPINS) {
+            sched_yield();
+            spins += 1;
+        }
+        if (spins == NR_SPINS) {
+            pthread_mutex_lock(&r->lock);
+            __atomic_store_n(&r->sleeping, true, __ATOMIC_SEQ_CST);
+            while (__atomic_load_n(&r->tail, __ATOMIC_SEQ_CST) == head) {
+                pthread_cond_wait(&r->wake, &r->lock);
+            }
+            __atomic_store_n(&r->sleeping, false, __ATOMIC_SEQ_CST);
+            pthread_mutex_unlock(&r->lock);
+        }
+        *stall += now() - started;
+    }
+    r->head = head + 1;
+    return r->slots[head % RING_SIZE];
+}
+
+
+static void*
+read_blocks(void* unused)
+{
+/*
+    The reader fills empty blocks from stdin until the end or an error, which
+    is passed along as a block of length 0 or -1.
+*/
+    struct block* b;
+    ssize_t n;
+    do {
+        b = take_block(&empty_input, &reader_stall);
+        do {
+            n = read(0, b->data, BLOCK_SIZE);
+        } while (n < 0 && errno == EINTR);
+        b->length = n;
+        put_block(&full_input, b);
+    } while (n > 0);
+    return unused;
+}
+
+
+static void*
+write_blocks(void* unused)
+{
+/*
+    The writer writes full blocks to stdout until it gets an empty one. After
+    a write error, it just notes the failure and returns the blocks.
+*/
+    struct block* b;
+    unsigned char* p;
+    ssize_t n, written;
+    for (;;) {
+        b = take_block(&full_output, &writer_stall);
+        if (b->length == 0) {
+            break;
+        }
+        p = b->data;
+        n = b->length;
+        while (n > 0 && !__atomic_load_n(&write_failed, __ATOMIC_RELAXED)) {
+            written = write(1, p, n);
+            if (written >= 0) {
+                p += written;
+                n -= written;
+            } else if (errno != EINTR) {
+                __atomic_store_n(&write_failed, true, __ATOMIC_RELAXED);
+            }
+        }
+        put_block(&empty_output, b);
+    }
+    return unused;
+}
+
+
+static ssize_t
+receive(unsigned char* p)
+{
+/*
+    Copy the next block from the reader to p, and return its length.
+*/
+    struct block* b = take_block(&full_input, &input_stall);
+    ssize_t n = b->length;
+    if (n > 0) {
+        memcpy(p, b->data, n);
+    }
+    put_block(&empty_input, b);
+    if (n < 0) {
+        fail(JSDEV_READ_ERROR, "read error.");
+    }
+    return n;
+}
+
+
+static void
+deliver(struct iovec* v, int n)
+{
+/*
+    Copy the vectors into output blocks, giving each block to the writer when
+    it is full.
+*/
+    size_t length;
+    if (__atomic_load_n(&write_failed, __ATOMIC_RELAXED)) {
+        fail(JSDEV_WRITE_ERROR, "write error.");
+    }
+    while (n > 0) {
+        if (current == NULL) {
+            current = take_block(&empty_output, &output_stall);
+            current->length = 0;
+        }
+        length = BLOCK_SIZE - current->length;
+        if (length > v->iov_len) {
+            length = v->iov_len;
+        }
+        memcpy(current->data + current->length, v->iov_base, length);
+        current->length += length;
+        v->iov_base = (char*) v->iov_base + length;
+        v->iov_len -= length;
+        if (current->length == BLOCK_SIZE) {
+            put_block(&full_output, current);
+            current = NULL;
+        }
+        if (v->iov_len == 0) {
+            v += 1;
+            n -= 1;
+        }
+    }
+}
+
+
+static void
+start_pipeline()
+{
+/*
+    Start the reader and the writer. If they can't be started, the program is
+    processed without them.
+*/
+    struct block* blocks;
+    pthread_t reader;
+    int i;
+
+    blocks = (struct block*) malloc(2 * NR_BLOCKS * sizeof(struct block));
+    if (blocks == NULL) {
+        return;
+    }
+    open_ring(&full_input);
+    open_ring(&empty_input);
+    open_ring(&full_output);
+    open_ring(&empty_output);
+    for (i = 0; i < NR_BLOCKS; i += 1) {
+        put_block(&empty_input, &blocks[i]);
+        put_block(&empty_output, &blocks[NR_BLOCKS + i]);
+    }
+    if (pthread_create(&writer, NULL, write_blocks, NULL) != 0) {
+        return;
+    }
+    pipelined = true;
+    if (pthread_create(&reader, NULL, read_blocks, NULL) != 0) {
+        finish();
+        return;
+    }
+    pthread_detach(reader);
+}
+
+
+static void
+finish()
+{
+/*
+    Give the last of the output to the writer, followed by an empty block to
+    stop it, and wait for it to finish. The reader is not waited for, since
+    the input need not be read to its end.
+*/
+    if (current != NULL && current->length > 0) {
+        put_block(&full_output, current);
+        current = NULL;
+    }
+    if (current == NULL) {
+        current = take_block(&empty_output, &output_stall);
+    }
+    current->length = 0;
+    put_block(&full_output, current);
+    current = NULL;
+    pthread_join(writer, NULL);
+    pipelined = false;
+    if (write_failed) {
+        fail(JSDEV_WRITE_ERROR, "write error.");
+    }
+}
+
+
+#ifdef URING
+
+static void
+uring_submit(int opcode, int fd, unsigned buffer_nr, size_t start,
+        size_t length)
+{
+/*
+    Queue a read or write of part of a registered buffer, at the file's
+    current position, and submit it.
+*/
+    unsigned tail = *ring.sq_tail;
+    unsigned index = tail & *ring.sq_mask;
+    struct io_uring_sqe* sqe = &ring.sqes[index];
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    sqe->opcode = (unsigned char) opcode;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t) (uintptr_t) (ring.buffers[buffer_nr] + start);
+    sqe->len = (unsigned) length;
+    sqe->off = (uint64_t) -1;
+    sqe->buf_index = (unsigned short) buffer_nr;
+    sqe->user_data = opcode == IORING_OP_READ_FIXED ? URING_READ : URING_WRITE;
+    ring.sq_array[index] = index;
+    __atomic_store_n(ring.sq_tail, tail + 1, __ATOMIC_RELEASE);
+    while (syscall(__NR_io_uring_enter, ring.fd, 1, 0, 0, NULL, 0) < 0) {
+        if (errno != EINTR) {
+            error("io_uring error.");
+        }
+    }
+}
+
+
+static void
+uring_start_read()
+{
+    uring_submit(IORING_OP_READ_FIXED, 0, 0, 0, BLOCK_SIZE);
+    reading_pending = true;
+}
+
+
+static void
+uring_start_write()
+{
+    uring_submit(IORING_OP_WRITE_FIXED, 1, writing, write_start,
+            write_length);
+    writing_pending = true;
+}
+
+
+static void
+uring_complete()
+{
+/*
+    Wait for the next completion, and note its result. A write that was cut
+    short is continued, and a read or write that was interrupted is tried
+    again.
+*/
+    unsigned head = *ring.cq_head;
+    struct io_uring_cqe* cqe;
+    while (__atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE) == head) {
+        if (syscall(__NR_io_uring_enter, ring.fd, 0, 1,
+                IORING_ENTER_GETEVENTS, NULL, 0) < 0 && errno != EINTR) {
+            error("io_uring error.");
+        }
+    }
+    cqe = &ring.cqes[head & *ring.cq_mask];
+    if (cqe->user_data == URING_READ) {
+        read_result = cqe->res;
+        reading_pending = false;
+        if (read_result == -EINTR || read_result == -EAGAIN) {
+            uring_start_read();
+        }
+    } else if (cqe->res == -EINTR || cqe->res == -EAGAIN) {
+        writing_pending = false;
+        uring_start_write();
+    } else if (cqe->res < 0) {
+        writing_pending = false;
+        fail(JSDEV_WRITE_ERROR, "write error.");
+    } else {
+        write_start += (size_t) cqe->res;
+        write_length -= (size_t) cqe->res;
+        writing_pending = false;
+        if (write_length > 0) {
+            uring_start_write();
+        }
+    }
+    __atomic_store_n(ring.cq_head, head + 1, __ATOMIC_RELEASE);
+}
+
+
+static ssize_t
+uring_receive(unsigned char* p)
+{
+/*
+    Copy the block that has been read to p, start reading the next one, and
+    return the length.
+*/
+    ssize_t n;
+    while (reading_pending) {
+        uring_complete();
+    }
+    n = read_result;
+    if (n < 0) {
+        fail(JSDEV_READ_ERROR, "read error.");
+    }
+    if (n > 0) {
+        memcpy(p, ring.buffers[0], n);
+        uring_start_read();
+    }
+    return n;
+}
+
+
+static void
+uring_write()
+{
+/*
+    Write the buffer that was being filled, after the last write has
+    finished, and switch to the other buffer.
+*/
+    while (writing_pending) {
+        uring_complete();
+    }
+    writing = filling;
+    filling = 3 - filling;
+    write_start = 0;
+    write_length = filled;
+    filled = 0;
+    uring_start_write();
+}
+
+
+static void
+uring_deliver(struct iovec* v, int n)
+{
+/*
+    Copy the vectors into the output buffer, writing it when it is full.
+*/
+    size_t length;
+    while (n > 0) {
+        length = BLOCK_SIZE - filled;
+        if (length > v->iov_len) {
+            length = v->iov_len;
+        }
+        memcpy(ring.buffers[filling] + filled, v->iov_base, length);
+        filled += length;
+        v->iov_base = (char*) v->iov_base + length;
+        v->iov_len -= length;
+        if (filled == BLOCK_SIZE) {
+            uring_write();
+        }
+        if (v->iov_len == 0) {
+            v += 1;
+            n -= 1;
+        }
+    }
+}
+
+
+static void
+uring_finish()
+{
+/*
+    Write what is left, and wait for the writes to finish.
+*/
+    uring_on = false;
+    if (filled > 0) {
+        uring_write();
+    }
+    while (writing_pending) {
+        uring_complete();
+    }
+}
+
+
+static int
+uring_setup()
+{
+/*
+    Set up the ring and its buffers, and start the first read. Return false if
+    the system doesn't allow it.
+*/
+    struct io_uring_params params;
+    struct iovec v[3];
+    unsigned char* sq;
+    unsigned char* cq;
+    size_t sq_size, cq_size;
+    int fd, i;
+
+    memset(&params, 0, sizeof(params));
+    fd = (int) syscall(__NR_io_uring_setup, 4, &params);
+    if (fd < 0) {
+        return false;
+    }
+    if (!(params.features & IORING_FEAT_RW_CUR_POS)) {
+        close(fd);
+        return false;
+    }
+    sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_size = params.cq_off.cqes
+        + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        sq_size = cq_size = sq_size > cq_size ? sq_size : cq_size;
+    }
+    sq = (unsigned char*) mmap(NULL, sq_size, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    cq = sq;
+    if (sq != MAP_FAILED && !(params.features & IORING_FEAT_SINGLE_MMAP)) {
+        cq = (unsigned char*) mmap(NULL, cq_size, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    }
+    ring.sqes = (struct io_uring_sqe*) mmap(NULL,
+            params.sq_entries * sizeof(struct io_uring_sqe),
+            PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+            IORING_OFF_SQES);
+    ring.buffers[0] = (unsigned char*) malloc(3 * BLOCK_SIZE);
+    if (sq == MAP_FAILED || cq == MAP_FAILED || ring.sqes == MAP_FAILED ||
+            ring.buffers[0] == NULL) {
+        close(fd);
+        return false;
+    }
+    for (i = 0; i < 3; i += 1) {
+        ring.buffers[i] = ring.buffers[0] + i * BLOCK_SIZE;
+        v[i].iov_base = ring.buffers[i];
+        v[i].iov_len = BLOCK_SIZE;
+    }
+    if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_BUFFERS, v,
+            3) < 0) {
+        close(fd);
+        return false;
+    }
+    ring.fd = fd;
+    ring.sq_tail = (unsigned*) (sq + params.sq_off.tail);
+    ring.sq_mask = (unsigned*) (sq + params.sq_off.ring_mask);
+    ring.sq_array = (unsigned*) (sq + params.sq_off.array);
+    ring.cq_head = (unsigned*) (cq + params.cq_off.head);
+    ring.cq_tail = (unsigned*) (cq + params.cq_off.tail);
+    ring.cq_mask = (unsigned*) (cq + params.cq_off.ring_mask);
+    ring.cqes = (struct io_uring_cqe*) (cq + params.cq_off.cqes);
+    uring_on = true;
+    uring_start_read();
+    return true;
+}
+
+#else
+
+static ssize_t
+uring_receive(unsigned char* p)
+{
+    (void) p;
+    return 0;
+}
+
+
+static void
+uring_deliver(struct iovec* v, int n)
+{
+    (void) v;
+    (void) n;
+}
+
+
+static void
+uring_finish()
+{
+}
+
+
+static int
+uring_setup()
+{
+    return false;
+}
+
+#endif
+
+
+static int
+ready()
+{
+/*
+    Return true if there is a character at the cursor, reading another block
+    if this one is used up. The sentinel makes this a single test in the usual
+    case. Only the 0 at limit is the sentinel. A NUL character before it is
+    not a character of the program, as it was not when the input was read
+    with fgetc: get and peek give EOF for it, which ends a line comment and
+    leaves a literal, a comment, or a condition unterminated. Program text
+    and stuff drop it with drop_nul and go on.
+*/
+    return *at != 0 || (at == limit && fill() && *at != 0);
+}
+
+
+static int
+drop_nul()
+{
+/*
+    After get gives EOF, return true if the cursor is at a NUL character and
+    not at the end of the input. The NUL is removed from the output.
+*/
+    if (at == limit) {
+        return false;
+    }
+    pass();
+    at += 1;
+    mark = at;
+    return true;
+}
+
+
+static int
+peek()
+{
+    return ready() ? *at : EOF;
+}
+
+
+static int
+get()
+{
+/*
+    Return the next character from the input. It stays in the output unless
+    it is cut.
+*/
+    int c;
+    if (!ready()) {
+        return EOF;
+    }
+    c = *at;
+    at += 1;
+    return c;
+}
+
+
+static void
+unget(int c)
+{
+/*
+    Back up over the character that was just gotten.
+*/
+    if (c != EOF) {
+        at -= 1;
+    }
+}
+
+
+static int
+pre_regexp(int left)
+{
+    return is(left, PRE_REGEXP);
+}
+
+
+static size_t
+intern(char* s, size_t length)
+{
+/*
+    Copy a string into the arena, and return its offset.
+*/
+    size_t offset = context->arena_length;
+    context->arena = (char*) enlarge(context->arena, &context->arena_size,
+            offset + length + 1);
+    memcpy(context->arena + offset, s, length);
+    context->arena[offset + length] = 0;
+    context->arena_length = offset + length + 1;
+    return offset;
+}
+
+
+static size_t
+slot(int from, int c)
+{
+/*
+    Return the slot of the edge from a node on a character, or else the empty
+    slot where that edge would go.
+*/
+    unsigned int h = (((unsigned int) from << 8) | (unsigned char) c) *
+            2654435761u;
+    size_t i, mask = context->edges_size - 1;
+    struct edge* edges = context->edges;
+
+    for (i = (h ^ (h >> 15)) & mask; edges[i].from != EOF; i = (i + 1) & mask) {
+        if (edges[i].from == from && edges[i].c == c) {
+            break;
+        }
+    }
+    return i;
+}
+
+
+static int
+step(int node, int c)
+{
+/*
+    Return the node reached from a node on a character, or EOF if no cmd
+    goes that way.
+*/
+    struct edge* edge = &context->edges[slot(node, c)];
+    return edge->from == EOF ? EOF : edge->to;
+}
+
+
+static int
+new_node()
+{
+    context->accepts = (int*) enlarge(context->accepts,
+            &context->accepts_size, (context->nr_nodes + 1) * sizeof(int));
+    context->accepts[context->nr_nodes] = EOF;
+    context->nr_nodes += 1;
+    return context->nr_nodes - 1;
+}
+
+
+static int
+add_edge(int from, int c)
+{
+/*
+    Add an edge to a new node, and return the node. The edge table is doubled
+    when it would be more than half full.
+*/
+    struct edge* old = context->edges;
+    size_t i, old_size = context->edges_size;
+
+    if ((size_t) (context->nr_edges + 1) * 2 > context->edges_size) {
+        context->edges_size = old_size * 2 < 64 ? 64 : old_size * 2;
+        context->edges = (struct edge*) malloc(context->edges_size *
+                sizeof(struct edge));
+        if (context->edges == NULL) {
+            fail(JSDEV_NO_MEMORY, "out of memory.");
+        }
+        for (i = 0; i < context->edges_size; i += 1) {
+            context->edges[i].from = EOF;
+        }
+        for (i = 0; i < old_size; i += 1) {
+            if (old[i].from != EOF) {
+                context->edges[slot(old[i].from, old[i].c)] = old[i];
+            }
+        }
+        if (old != no_edges) {
+            free(old);
+        }
+    }
+    i = slot(from, c);
+    context->edges[i].from = from;
+    context->edges[i].c = c;
+    context->edges[i].to = new_node();
+    context->nr_edges += 1;
+    return context->edges[i].to;
+}
+
+
+static void
+declare(char* name, size_t length, char* command)
+{
+/*
+    Add a cmd and its command, which may be NULL. If the same cmd is
+    declared twice, the first one wins.
+*/
+    int node = 0, next;
+    size_t i;
+    struct entry* entry;
+
+    if (context->nr_nodes == 0) {
+        new_node();
+    }
+    for (i = 0; i < length; i += 1) {
+        next = step(node, name[i]);
+        node = next != EOF ? next : add_edge(node, name[i]);
+    }
+    if (context->accepts[node] != EOF) {
+        return;
+    }
+    if (context->nr_cmds == MAX_NR_CMDS) {
+        fail(JSDEV_BAD_CMD, "too many cmds.");
+    }
+    context->entries = (struct entry*) enlarge(context->entries,
+            &context->entries_size, (context->nr_cmds + 1) * sizeof(struct entry));
+    entry = &context->entries[context->nr_cmds];
+    entry->name = intern(name, length);
+    entry->length = length;
+    entry->command = command == NULL
+        ? NO_COMMAND
+        : intern(command, strlen(command));
+    context->accepts[node] = context->nr_cmds;
+    context->nr_cmds += 1;
+}
+
+
+static unsigned char*
+locate()
+{
+/*
+    Return the last place in the mapped input where a pattern could begin,
+    or NULL if there is none. A pattern is a slash star, a cmd, and then a
+    character that can't be in a cmd. The patterns are found with an
+    Aho-Corasick automaton whose states are the root, the state after a
+    slash, and the nodes of the trie, which is entered after a slash star.
+    Every pattern begins with slash star, and no cmd contains a slash or a
+    star, so every failure leads back to the root, or to the slash state on
+    a slash. The root is only left at a slash star, and the comment scanner
+    finds those a block at a time.
+
+    A site found here can still turn out to be in a string or a comment. It
+    is the lexer that decides.
+*/
+    int node;
+    unsigned char* p = at;
+    unsigned char* q;
+    unsigned char* site = NULL;
+
+    if (context->nr_cmds == 0) {
+        return NULL;
+    }
+    for (;;) {
+        p = skip_comment(p);
+        if (p == limit) {
+            return site;
+        }
+        if (p[0] == '/' && p[1] == '*') {
+            node = 0;
+            for (q = p + 2; node != EOF && is_alphanum(*q); q += 1) {
+                node = step(node, *q);
+            }
+            if (node > 0 && context->accepts[node] != EOF) {
+                site = p;
+            }
+        }
+        p += 1;
+    }
+}
+
+
+/*
+    The lexer is a state machine. Each state takes one character, or looks at
+    the next character without taking it, and then picks the next state. A
+    state that can pass over a run of uninteresting characters uses a scanner
+    to get to the next interesting one.
+
+        CODE             program text
+        SLASH            a slash in program text
+        LINE_COMMENT     a slash slash comment
+        HEADER           after slash star, reading what might be a cmd
+        BLOCK_COMMENT    a comment that is not a pattern
+        COMMENT_SLASH    a slash in a comment, maybe starting a nested comment
+        COMMENT_STAR     a star in a comment, maybe ending it
+        OPENING          after a cmd, deciding if there is a condition
+        CONDITION        the condition of a pattern
+        CONDITION_SLASH  a slash in a condition
+        CONDITION_STAR   a star in a condition
+        STUFF            the stuff of a pattern
+        STUFF_SLASH      a slash in stuff
+        STUFF_STAR       a star in stuff, maybe ending the pattern
+        SINGLE           a single quoted string
+        DOUBLE           a double quoted string
+        TEMPLATE         a template literal
+        REGEXP           a regexp literal
+        REGEXP_CLASS     a set in a regexp
+
+    Each kind of literal has its own states, and PATTERN_ states for when it
+    is inside of a pattern, which is inside of a comment, so it may not contain
+    a star slash. That way the quote and the need to look for a star are
+    known when the code is compiled rather than tested on every character.
+    Each literal state also has _ESCAPE and _STAR states, for after a
+    backslash and for a star that might be closing the comment. A regexp
+    also has a _SLASH state, for the end of a regexp in a pattern.
+
+    A literal in program text returns to CODE. A literal in a pattern returns
+    to the state in back.
+*/
+
+#define STRING_STATES(NAME) \
+    NAME, NAME##_ESCAPE, NAME##_STAR
+
+#define REGEXP_STATES(NAME) \
+    NAME, NAME##_ESCAPE, NAME##_SLASH, NAME##_STAR, \
+    NAME##_CLASS, NAME##_CLASS_ESCAPE, NAME##_CLASS_STAR
+
+enum state {
+    CODE,
+    SLASH,
+    LINE_COMMENT,
+    HEADER,
+    BLOCK_COMMENT,
+    COMMENT_SLASH,
+    COMMENT_STAR,
+    OPENING,
+    CONDITION,
+    CONDITION_SLASH,
+    CONDITION_STAR,
+    STUFF,
+    STUFF_SLASH,
+    STUFF_STAR,
+    STRING_STATES(SINGLE),
+    STRING_STATES(DOUBLE),
+    STRING_STATES(TEMPLATE),
+    STRING_STATES(PATTERN_SINGLE),
+    STRING_STATES(PATTERN_DOUBLE),
+    STRING_STATES(PATTERN_TEMPLATE),
+    REGEXP_STATES(REGEXP),
+    REGEXP_STATES(PATTERN_REGEXP)
+};
+
+LOCAL int state = CODE;
+LOCAL int back = CODE;          /* the state a pattern literal returns to */
+LOCAL int code_left = 0;        /* the last visible character in code */
+LOCAL int left = 0;             /* the last visible character in a pattern */
+LOCAL int paren = 0;            /* the depth of parens in a condition */
+LOCAL int node = 0;             /* the trie node of the cmd so far */
+LOCAL int word = 0;             /* the length of the word after slash star */
+LOCAL int cmd_nr = EOF;         /* the cmd of the pattern being expanded */
+
+
+static void
+open_literal(int literal, int from)
+{
+/*
+    Start a string or regexp literal that will return to the from state.
+*/
+    opening = position();
+    back = from;
+    state = literal;
+}
+
+
+static void
+open_string(int quote, int from)
+{
+    if (from == CODE) {
+        open_literal(
+            quote == '\'' ? SINGLE : quote == '"' ? DOUBLE : TEMPLATE,
+            from
+        );
+    } else {
+        open_literal(
+            quote == '\'' ? PATTERN_SINGLE
+            : quote == '"' ? PATTERN_DOUBLE
+            : PATTERN_TEMPLATE,
+            from
+        );
+    }
+}
+
+
+static void
+open_stuff()
+{
+    emit('{');
+    if (context->entries[cmd_nr].command != NO_COMMAND) {
+        emits(context->arena + context->entries[cmd_nr].command);
+        emit('(');
+    }
+    left = '{';
+    state = STUFF;
+}
+
+
+static void
+close_stuff()
+{
+    if (context->entries[cmd_nr].command != NO_COMMAND) {
+        emit(')');
+    }
+    emits(";}");
+    state = CODE;
+/*
+    Once past the last site where a pattern can occur, the rest of the input
+    can go out verbatim.
+*/
+    if (mapped && chunk == NULL && at > last_site) {
+        pass();
+        verbatim = true;
+    }
+}
+
+
+/*
+    The states of the literals are made by these macros, one instance for each
+    kind of literal, so that the quote and in_pattern are constants.
+*/
+
+#define STRING_CASES(NAME, QUOTE, in_pattern)                               \
+        case NAME:                                                          \
+            at = skip_to(at, &string_set[in_pattern][                       \
+                QUOTE == '\'' ? 0 : QUOTE == '"' ? 1 : 2                    \
+            ]);                                                             \
+            c = get();                                                      \
+            if (c == QUOTE) {                                               \
+                state = in_pattern ? back : CODE;                           \
+            } else if (c == '\\') {                                         \
+                state = NAME##_ESCAPE;                                      \
+            } else if (in_pattern && c == '*') {                            \
+                state = NAME##_STAR;                                        \
+            } else if (c == EOF) {                                          \
+                error_at(opening, "unterminated string literal.");          \
+            }                                                               \
+            break;                                                          \
+        case NAME##_ESCAPE:                                                 \
+            c = get();                                                      \
+            if (c == EOF) {                                                 \
+                error_at(opening, "unterminated string literal.");          \
+            }                                                               \
+            state = in_pattern && c == '*' ? NAME##_STAR : NAME;            \
+            break;                                                          \
+        case NAME##_STAR:                                                   \
+            if (peek() == '/') {                                            \
+                error("unexpected close comment in string.");               \
+            }                                                               \
+            state = NAME;                                                   \
+            break;
+
+#define REGEXP_CASES(NAME, in_pattern)                                      \
+        case NAME:                                                          \
+            at = skip_to(at, &regexp_set[in_pattern]);                      \
+            c = get();                                                      \
+            if (c == '[') {                                                 \
+                state = NAME##_CLASS;                                       \
+            } else if (c == '/') {                                          \
+                state = in_pattern ? NAME##_SLASH : CODE;                   \
+            } else if (c == '\\') {                                         \
+                state = NAME##_ESCAPE;                                      \
+            } else if (in_pattern && c == '*') {                            \
+                state = NAME##_STAR;                                        \
+            } else if (c == EOF) {                                          \
+                error_at(opening, "unterminated regexp literal.");          \
+            }                                                               \
+            break;                                                          \
+        case NAME##_ESCAPE:                                                 \
+            c = get();                                                      \
+            if (c == EOF) {                                                 \
+                error_at(opening, "unterminated regexp literal.");          \
+            }                                                               \
+            state = in_pattern && c == '*' ? NAME##_STAR : NAME;            \
+            break;                                                          \
+        case NAME##_SLASH:                                                  \
+            c = peek();                                                     \
+            if (c == '/' || c == '*') {                                     \
+                error("unexpected comment.");                               \
+            }                                                               \
+            state = back;                                                   \
+            break;                                                          \
+        case NAME##_STAR:                                                   \
+            if (peek() == '/') {                                            \
+                error("unexpected comment.");                               \
+            }                                                               \
+            state = NAME;                                                   \
+            break;                                                          \
+        case NAME##_CLASS:                                                  \
+            at = skip_to(at, &class_set[in_pattern]);                       \
+            c = get();                                                      \
+            if (c == ']') {                                                 \
+                state = NAME;                                               \
+            } else if (c == '\\') {                                         \
+                state = NAME##_CLASS_ESCAPE;                                \
+            } else if (in_pattern && c == '*') {                            \
+                state = NAME##_CLASS_STAR;                                  \
+            } else if (c == EOF) {                                          \
+                error("unterminated set in Regular Expression literal.");   \
+            }                                                               \
+            break;                                                          \
+        case NAME##_CLASS_ESCAPE:                                           \
+            c = get();                                                      \
+            if (c == EOF) {                                                 \
+                error("unterminated set in Regular Expression literal.");   \
+            }                                                               \
+            state = in_pattern && c == '*'                                  \
+                ? NAME##_CLASS_STAR                                         \
+                : NAME##_CLASS;                                             \
+            break;                                                          \
+        case NAME##_CLASS_STAR:                                             \
+            if (peek() == '/') {                                            \
+                error("unexpected close comment in regexp.");               \
+            }                                                               \
+            state = NAME##_CLASS;                                           \
+            break;
+
+
+static void
+lex()
+{
+/*
+    Run the state machine until the end of the program text.
+*/
+    int c;
+    for (;;) {
+        switch (state) {
+        case CODE:
+/*
+    Skip over the characters that just pass through, noting the last one that
+    was not whitespace.
+*/
+            at = skip_code(at, &code_left);
+            c = get();
+            if (c == EOF) {
+                if (!drop_nul()) {
+                    return;
+                }
+                break;
+            }
+            if (is(c, QUOTE)) {
+                open_string(c, CODE);
+/*
+    The most complicated case is the slash. It can mean division or a regexp
+    literal or a line comment or a block comment. A block comment can also be
+    a pattern to be expanded, in which case the slash will be cut, so it is
+    held until we know.
+*/
+            } else if (c == '/') {
+                hold = at - 1;
+                state = SLASH;
+            } else if (!is(c, SPACE)) {
+                code_left = c;
+            }
+            break;
+        case SLASH:
+            c = peek();
+            if (c == '/') {
+                get();
+                hold = NULL;
+                state = LINE_COMMENT;
+            } else if (c == '*') {
+                get();
+                node = 0;
+                word = 0;
+                state = HEADER;
+            } else {
+                hold = NULL;
+                state = CODE;
+/*
+    We are looking at a single slash. Is it a division operator, or is it the
+    start of a regexp literal? If is not possible to tell for sure without doing
+    a complete parse of the program, and we are not going to do that. Instead,
+    we are adopting the convention that a regexp literal must have one of a
+    small set of characters to its left.
+*/
+                if (pre_regexp(code_left)) {
+                    open_literal(REGEXP, CODE);
+                }
+                code_left = '/';
+            }
+            break;
+        case LINE_COMMENT:
+            at = skip_to(at, &line_set);
+            c = get();
+            if (c == '\n' || c == '\r' || c == EOF) {
+                state = CODE;
+            }
+            break;
+        case HEADER:
+/*
+    The first component of a slash star comment might be the cmd. Follow it
+    through the trie until it ends. Once no cmd can match, the rest of the word
+    is still read, up to WORD_LENGTH, so that the character after it can be
+    looked at.
+*/
+            c = get();
+            if (is_alphanum(c)) {
+                word += 1;
+                if (node != EOF) {
+                    node = step(node, c);
+                    if (node == EOF) {
+                        hold = NULL;
+                    }
+                }
+                if (node == EOF && word >= WORD_LENGTH) {
+                    state = BLOCK_COMMENT;
+                }
+            } else {
+                if ((c == '\r' || c == '\n') && word < WORD_LENGTH) {
+                    twice += 1;
+                }
+                unget(c);
+                cmd_nr = node > 0 ? context->accepts[node] : EOF;
+                if (cmd_nr != EOF) {
+                    cut(hold);
+                    state = OPENING;
+                } else {
+                    hold = NULL;
+                    state = BLOCK_COMMENT;
+                }
+            }
+            break;
+        case BLOCK_COMMENT:
+            at = skip_comment(at);
+            c = get();
+            if (c == EOF) {
+                error("unterminated comment.");
+            } else if (c == '/') {
+                state = COMMENT_SLASH;
+            } else if (c == '*') {
+                state = COMMENT_STAR;
+            }
+            break;
+        case COMMENT_SLASH:
+            if (peek() == '*') {
+                get();
+                error("nested comment.");
+            }
+            state = BLOCK_COMMENT;
+            break;
+        case COMMENT_STAR:
+            if (peek() == '/') {
+                get();
+                state = CODE;
+            } else {
+                state = BLOCK_COMMENT;
+            }
+            break;
+        case OPENING:
+            if (peek() == '(') {
+                emits("if ");
+                paren = 0;
+                state = CONDITION;
+            } else {
+                open_stuff();
+            }
+            break;
+        case CONDITION:
+            c = get();
+            if (is(c, OPENER)) {
+                paren += 1;
+            } else if (is(c, CLOSER)) {
+                paren -= 1;
+                if (paren == 0) {
+                    open_stuff();
+                    break;
+                }
+            } else if (c == EOF) {
+                error("Unterminated condition.");
+            } else if (is(c, QUOTE)) {
+                open_string(c, CONDITION);
+            } else if (c == '/') {
+                state = CONDITION_SLASH;
+                break;
+            } else if (c == '*') {
+                state = CONDITION_STAR;
+                break;
+            }
+            if (!is(c, SPACE)) {
+                left = c;
+            }
+            break;
+        case CONDITION_SLASH:
+        case STUFF_SLASH:
+            c = peek();
+            if (c == '/' || c == '*') {
+                error("unexpected comment.");
+            }
+            state = state == CONDITION_SLASH ? CONDITION : STUFF;
+            if (pre_regexp(left)) {
+                open_literal(PATTERN_REGEXP, state);
+            }
+            left = '/';
+            break;
+        case CONDITION_STAR:
+            if (peek() == '/') {
+                error("unclosed condition.");
+            }
+            left = '*';
+            state = CONDITION;
+            break;
+        case STUFF:
+/*
+    The stuff is passed through. The closing star slash is cut.
+*/
+            c = get();
+            if (c == '*') {
+                hold = at - 1;
+                state = STUFF_STAR;
+                break;
+            } else if (c == EOF) {
+                if (!drop_nul()) {
+                    error("Unterminated stuff.");
+                }
+                break;
+            } else if (is(c, QUOTE)) {
+                open_string(c, STUFF);
+            } else if (c == '/') {
+                state = STUFF_SLASH;
+                break;
+            }
+            if (!is(c, SPACE)) {
+                left = c;
+            }
+            break;
+        case STUFF_STAR:
+            if (peek() == '/') {
+                get();
+                cut(hold);
+                close_stuff();
+            } else {
+                hold = NULL;
+                state = STUFF;
+            }
+            break;
+        STRING_CASES(SINGLE, '\'', false)
+        STRING_CASES(DOUBLE, '"', false)
+        STRING_CASES(TEMPLATE, '`', false)
+        STRING_CASES(PATTERN_SINGLE, '\'', true)
+        STRING_CASES(PATTERN_DOUBLE, '"', true)
+        STRING_CASES(PATTERN_TEMPLATE, '`', true)
+        REGEXP_CASES(REGEXP, false)
+        REGEXP_CASES(PATTERN_REGEXP, true)
+        }
+    }
+}
+
+
+static void
+process()
+{
+/*
+    Loop through the program text, looking for patterns. Everything that is
+    not part of a pattern passes through to the output.
+*/
+    reading = true;
+    state = CODE;
+    lex();
+    pass();
+    flush();
+}
+
+
+static void
+reset()
+{
+/*
+    Return the input, the output, and the lexer to where they start, so that
+    another program can be processed.
+*/
+    at = first + 1;
+    limit = at;
+    mark = at;
+    start = at;
+    hold = NULL;
+    at_eof = false;
+    mapped = false;
+    verbatim = false;
+    last_site = NULL;
+    cant_copy = false;
+    cant_splice = false;
+    cant_send = false;
+    source = NULL;
+    out_length = 0;
+    consumed = 0;
+    lines = 0;
+    after_cr = false;
+    opening = 0;
+    opening_line = 0;
+    twice = 0;
+    word = 0;
+    state = CODE;
+    back = CODE;
+    code_left = 0;
+    left = 0;
+    paren = 0;
+    node = 0;
+    cmd_nr = EOF;
+}
+
+
+static int
+in_pattern(int s)
+{
+/*
+    Return true if the state is inside of a pattern. This depends on the order
+    of the states.
+*/
+    return (s >= OPENING && s <= STUFF_STAR)
+        || (s >= PATTERN_SINGLE && s < REGEXP)
+        || s >= PATTERN_REGEXP;
+}
+
+
+static void
+normalize(struct snapshot* s)
+{
+/*
+    Clear the parts of a snapshot that do not matter in its state, so that
+    snapshots that will act the same are the same. Only one thing matters
+    about the characters to the left: whether a regexp may follow them.
+*/
+    s->code_left = is(s->code_left, PRE_REGEXP) ? '(' : 0;
+    s->left = is(s->left, PRE_REGEXP) ? '(' : 0;
+    if (!in_pattern(s->state)) {
+        s->back = CODE;
+        s->left = 0;
+        s->paren = 0;
+        s->cmd_nr = EOF;
+    }
+    if (s->state != HEADER) {
+        s->node = 0;
+    }
+}
+
+
+static int
+same(struct snapshot* a, struct snapshot* b)
+{
+    return a->state == b->state
+        && a->back == b->back
+        && a->code_left == b->code_left
+        && a->left == b->left
+        && a->paren == b->paren
+        && a->node == b->node
+        && a->cmd_nr == b->cmd_nr
+        && a->held == b->held;
+}
+
+
+static void
+take(struct snapshot* s)
+{
+    s->state = state;
+    s->back = back;
+    s->code_left = code_left;
+    s->left = left;
+    s->paren = paren;
+    s->node = node;
+    s->cmd_nr = cmd_nr;
+    s->held = hold != NULL ? (size_t) (at - hold) : 0;
+    normalize(s);
+}
+
+
+static void
+checkpoint()
+{
+/*
+    At each step through a chunk, the primary notes its state, and any other
+    guess stops if it is now in the same state. At the end of a chunk that is
+    not the last, the run is suspended so that it can be stitched to the next.
+*/
+    struct snapshot here;
+    take(&here);
+    if (run == &chunk->runs[0]) {
+        chunk->checkpoints = (struct snapshot*) enlarge(chunk->checkpoints,
+                &chunk->checkpoints_size,
+                (nr_steps + 1) * sizeof(struct snapshot));
+        chunk->checkpoints[nr_steps] = here;
+        chunk->nr_checkpoints = nr_steps + 1;
+    } else if (run != &chunk->real && nr_steps < chunk->nr_checkpoints &&
+            same(&here, &chunk->checkpoints[nr_steps])) {
+        run->result = CONVERGED;
+        longjmp(escape, 1);
+    }
+    nr_steps += 1;
+    if (source == source_end && !chunk->last) {
+        run->end = here;
+        run->result = SUSPENDED;
+        longjmp(escape, 1);
+    }
+}
+
+
+static void
+collect(struct iovec* v, int n)
+{
+/*
+    Keep the output of a run in its chunk, if it is being kept.
+*/
+    while (keeping && n > 0) {
+        if (v->iov_len > 0) {
+            chunk->output = (unsigned char*) enlarge(chunk->output,
+                    &chunk->output_size, chunk->output_length + v->iov_len);
+            memcpy(chunk->output + chunk->output_length, v->iov_base,
+                    v->iov_len);
+            chunk->output_length += v->iov_len;
+        }
+        v += 1;
+        n -= 1;
+    }
+}
+
+
+static void
+refer(unsigned char* p, size_t length)
+{
+/*
+    Note in the chunk, if its output is being kept, that a span of the input
+    comes next in it. p is in the buffer, which holds a copy of the input
+    that ends at source.
+*/
+    struct span* s;
+    if (!keeping) {
+        return;
+    }
+    chunk->spans = (struct span*) enlarge(chunk->spans, &chunk->spans_size,
+            (chunk->nr_spans + 1) * sizeof(struct span));
+    s = &chunk->spans[chunk->nr_spans];
+    s->at = chunk->output_length;
+    s->from = source - (limit - p);
+    s->length = length;
+    chunk->nr_spans += 1;
+}
+
+
+static void
+begin(struct run* r)
+{
+/*
+    Set up the input and the lexer to run the chunk from the start of r. The
+    held characters come before the chunk, and are gotten again.
+*/
+    struct snapshot* s = &r->start;
+    reset();
+    mapped = true;
+    run = r;
+    nr_steps = 0;
+    source = chunk->from - s->held;
+    source_end = chunk->to;
+    state = s->state;
+    back = s->back;
+    code_left = s->code_left;
+    left = s->left;
+    paren = s->paren;
+    node = s->node;
+    cmd_nr = s->cmd_nr;
+    if (s->held > 0) {
+        fill();
+        hold = at;
+        at += s->held;
+    }
+}
+
+
+static void
+lex_chunk(struct run* r, int keep)
+{
+/*
+    Lex the chunk from the start of the run, noting how it ended. If keep,
+    the output is kept in the chunk.
+*/
+    keeping = keep;
+    r->result = RUNNING;
+    if (setjmp(escape) == 0) {
+        begin(r);
+        lex();
+        pass();
+        flush();
+        r->result = DONE;
+    } else if (r->result == SUSPENDED) {
+        flush();
+    }
+}
+
+
+static void
+guess(struct chunk* c)
+{
+/*
+    Lex a chunk from each of its guesses. The primary goes first, so that the
+    others can stop when they agree with it.
+*/
+    int i;
+    for (i = 0; i < c->nr_runs; i += 1) {
+        lex_chunk(&c->runs[i], i == 0);
+    }
+}
+
+
+static void
+redo(struct chunk* c)
+{
+/*
+    Lex a chunk from its real start, keeping the output.
+*/
+    c->output_length = 0;
+    c->nr_spans = 0;
+    lex_chunk(&c->real, true);
+}
+
+
+/*
+    The threads take their jobs from the chunks. A chunk that must be run
+    again comes first, since the output is waiting for it, and then the next
+    chunk to be guessed. Meanwhile the main thread stitches each chunk as soon
+    as it has been guessed, and writes it as soon as its output is ready and
+    the chunks before it have been written. jobs_lock guards these, and the
+    guessed and ready flags of the chunks.
+*/
+
+static pthread_mutex_t jobs_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  job_added = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t  job_done = PTHREAD_COND_INITIALIZER;
+static struct chunk*   guesses;
+static int             nr_guesses;
+static int             next_guess;
+static struct chunk**  redos;
+static int             nr_redos;
+static int             next_redo;
+static int             jobs_over;
+
+
+static void*
+work(void* shared)
+{
+/*
+    A thread does jobs until they are over, with the shared context.
+*/
+    struct chunk* c;
+    context = (struct jsdev_ctx*) shared;
+    pthread_mutex_lock(&jobs_lock);
+    while (!jobs_over) {
+        if (next_redo < nr_redos) {
+            c = redos[next_redo];
+            next_redo += 1;
+            pthread_mutex_unlock(&jobs_lock);
+            chunk = c;
+            redo(c);
+            pthread_mutex_lock(&jobs_lock);
+            c->ready = true;
+            pthread_cond_signal(&job_done);
+        } else if (next_guess < nr_guesses) {
+            c = &guesses[next_guess];
+            next_guess += 1;
+            pthread_mutex_unlock(&jobs_lock);
+            chunk = c;
+            guess(c);
+            pthread_mutex_lock(&jobs_lock);
+            c->guessed = true;
+            pthread_cond_signal(&job_done);
+        } else {
+            pthread_cond_wait(&job_added, &jobs_lock);
+        }
+    }
+    pthread_mutex_unlock(&jobs_lock);
+    chunk = NULL;
+    free(buffer);
+    buffer = NULL;
+    buffer_size = 0;
+    return shared;
+}
+
+
+static size_t
+write_chunk(struct chunk* c)
+{
+/*
+    Write the output of a chunk, copying its spans from the input, and free
+    it. Return the number of characters written.
+*/
+    struct iovec v[1];
+    size_t done = 0, length = c->output_length, i;
+    for (i = 0; i < c->nr_spans; i += 1) {
+        v[0].iov_base = c->output + done;
+        v[0].iov_len = c->spans[i].at - done;
+        drain(v, 1);
+        transfer(c->spans[i].from, c->spans[i].length);
+        done = c->spans[i].at;
+        length += c->spans[i].length;
+    }
+    v[0].iov_base = c->output + done;
+    v[0].iov_len = c->output_length - done;
+    drain(v, 1);
+    free(c->output);
+    free(c->spans);
+    free(c->checkpoints);
+    c->output = NULL;
+    c->spans = NULL;
+    c->checkpoints = NULL;
+    return length;
+}
+
+
+static void
+process_in_parallel(int nr_threads)
+{
+/*
+    Process the mapped program with the help of up to nr_threads threads.
+*/
+    static int starts[NR_GUESSES][2] = {
+        {CODE, 0}, {CODE, '('},
+        {SINGLE, 0}, {SINGLE, '('},
+        {DOUBLE, 0}, {DOUBLE, '('},
+        {TEMPLATE, 0}, {TEMPLATE, '('},
+        {BLOCK_COMMENT, 0}, {BLOCK_COMMENT, '('},
+        {LINE_COMMENT, 0}, {LINE_COMMENT, '('},
+        {REGEXP, '/'}, {REGEXP_CLASS, '/'}
+    };
+    pthread_t threads[256];
+    struct chunk* chunks;
+    struct chunk** list;
+    struct chunk* c;
+    struct run* r;
+    struct snapshot real;
+    size_t length = (size_t) (limit - at), size, written = 0;
+    unsigned char* p;
+    int i, j, nr_chunks, nr_used, nr_stitched = 0, nr_written = 0,
+        started = 0, stalled = false, ok = true;
+
+    nr_chunks = nr_threads * 4;
+    if (length / MIN_CHUNK_SIZE < (size_t) nr_chunks) {
+        nr_chunks = (int) (length / MIN_CHUNK_SIZE);
+    }
+    if (nr_chunks < 2) {
+        process();
+        return;
+    }
+    chunks = (struct chunk*) calloc(nr_chunks, sizeof(struct chunk));
+    list = (struct chunk**) malloc(nr_chunks * sizeof(struct chunk*));
+    if (chunks == NULL || list == NULL) {
+        free(chunks);
+        free(list);
+        process();
+        return;
+    }
+
+/*
+    Divide the program into chunks, and make the guesses. The first chunk
+    starts at the start, so its primary is right. For the others, the primary
+    guesses that the last visible character before the chunk is code.
+*/
+
+    size = length / nr_chunks;
+    memset(&real, 0, sizeof(struct snapshot));
+    real.state = CODE;
+    real.back = CODE;
+    real.cmd_nr = EOF;
+    for (i = 0; i < nr_chunks; i += 1) {
+        c = &chunks[i];
+        c->from = at + size * i;
+        c->to = i == nr_chunks - 1 ? limit : c->from + size;
+        c->last = i == nr_chunks - 1;
+        c->runs[0].start = real;
+        c->nr_runs = 1;
+        if (i > 0) {
+            for (p = c->from; p > at && is(p[-1], SPACE); p -= 1) {
+            }
+            c->runs[0].start.code_left = p > at ? p[-1] : 0;
+            normalize(&c->runs[0].start);
+            for (j = 0; j < NR_GUESSES; j += 1) {
+                r = &c->runs[c->nr_runs];
+                r->start = real;
+                r->start.state = starts[j][0];
+                r->start.code_left = starts[j][1];
+                normalize(&r->start);
+                if (!same(&r->start, &c->runs[0].start)) {
+                    c->nr_runs += 1;
+                }
+            }
+        }
+    }
+    nr_used = nr_chunks;
+    guesses = chunks;
+    nr_guesses = nr_chunks;
+    next_guess = 0;
+    redos = list;
+    nr_redos = 0;
+    next_redo = 0;
+    jobs_over = false;
+    if (nr_threads > nr_chunks) {
+        nr_threads = nr_chunks;
+    }
+    if (nr_threads > 256) {
+        nr_threads = 256;
+    }
+    for (i = 0; i < nr_threads; i += 1) {
+        if (pthread_create(&threads[started], NULL, work, context) == 0) {
+            started += 1;
+        }
+    }
+    ok = started > 0;
+    flush();
+
+/*
+    Stitch the chunks together as they are guessed. Each chunk's real start is
+    the end of the one before it. A chunk whose primary guessed wrong is run
+    again, and if its real start was not among the guesses, the stitching
+    waits for that. Each chunk is written once it is stitched and ready.
+*/
+
+    pthread_mutex_lock(&jobs_lock);
+    while (ok && nr_written < nr_used) {
+        c = &chunks[nr_stitched];
+        r = NULL;
+        if (stalled && c->ready) {
+            stalled = false;
+            r = &c->real;
+        } else if (!stalled && nr_stitched < nr_used && c->guessed) {
+            c->real.start = real;
+            for (j = 0; j < c->nr_runs; j += 1) {
+                if (same(&c->runs[j].start, &real)) {
+                    r = &c->runs[j];
+                    break;
+                }
+            }
+            if (r == NULL && real.held >= STEP_SIZE) {
+                ok = false;
+                break;
+            }
+            if (r == NULL || j > 0) {
+                redos[nr_redos] = c;
+                nr_redos += 1;
+                pthread_cond_signal(&job_added);
+                stalled = r == NULL;
+            } else {
+                c->ready = true;
+            }
+            if (r != NULL && r->result == CONVERGED) {
+                r = &c->runs[0];
+            }
+        } else if (nr_written < nr_stitched && chunks[nr_written].ready) {
+            c = &chunks[nr_written];
+            if (c->real.result == FAILED) {
+                ok = false;
+                break;
+            }
+            pthread_mutex_unlock(&jobs_lock);
+            written += write_chunk(c);
+            pthread_mutex_lock(&jobs_lock);
+            nr_written += 1;
+            continue;
+        } else {
+            pthread_cond_wait(&job_done, &jobs_lock);
+            continue;
+        }
+        if (r == NULL) {
+            continue;
+        }
+        if (r->result == FAILED) {
+            ok = false;
+        } else if (r->result == DONE) {
+            nr_used = nr_stitched + 1;
+            nr_guesses = nr_used;
+        } else {
+            real = r->end;
+        }
+        nr_stitched += 1;
+    }
+    jobs_over = true;
+    pthread_cond_broadcast(&job_added);
+    pthread_mutex_unlock(&jobs_lock);
+    for (i = 0; i < started; i += 1) {
+        pthread_join(threads[i], NULL);
+    }
+    for (i = 0; i < nr_chunks; i += 1) {
+        free(chunks[i].output);
+        free(chunks[i].spans);
+        free(chunks[i].checkpoints);
+    }
+    free(chunks);
+    free(list);
+
+/*
+    If the real chain fails anywhere, the program is processed sequentially,
+    without the output that has already been written.
+*/
+
+    if (!ok) {
+        skip = written;
+        process();
+    }
+}
+
+
+/*
+    libjsdev. While one of its functions runs, context is the context it was
+    given, and failure is set, so that a failure comes back as a status
+    instead of exiting.
+*/
+
+static pthread_once_t scanners_selected = PTHREAD_ONCE_INIT;
+
+/*
+    An out function may call libjsdev again while the call that gave it the
+    output is still running on the same thread. The state of that call is kept
+    in a frame until the new call returns, and the new call starts with a
+    buffer and an output buffer of its own. depth is the number of calls that
+    are running on the thread. A stream that is running can't be fed again.
+*/
+
+struct frame {
+    struct jsdev_ctx*    context;
+    unsigned char*       buffer;
+    size_t               buffer_size;
+    unsigned char*       at;
+    unsigned char*       limit;
+    unsigned char*       mark;
+    unsigned char*       hold;
+    int                  at_eof;
+    int                  mapped;
+    int                  verbatim;
+    unsigned char*       last_site;
+    unsigned char*       out;
+    size_t               out_size;
+    size_t               out_length;
+    jsdev_out            sink;
+    void*                sink_closure;
+    unsigned char*       source;
+    unsigned char*       source_end;
+    jmp_buf              escape;
+    struct jsdev_stream* stream;
+    int                  finishing;
+    struct jsdev_error*  failure;
+    unsigned char*       start;
+    size_t               consumed;
+    int                  lines;
+    int                  after_cr;
+    size_t               opening;
+    int                  opening_line;
+    int                  twice;
+    int                  reading;
+    int                  state;
+    int                  back;
+    int                  code_left;
+    int                  left;
+    int                  paren;
+    int                  node;
+    int                  word;
+    int                  cmd_nr;
+};
+
+LOCAL int             depth = 0;
+
+
+static void
+enter(struct frame* f)
+{
+/*
+    Begin a call. If another call is running, keep its state in the frame.
+*/
+    if (depth > 0) {
+        f->context = context;
+        f->buffer = buffer;
+        f->buffer_size = buffer_size;
+        f->at = at;
+        f->limit = limit;
+        f->mark = mark;
+        f->hold = hold;
+        f->at_eof = at_eof;
+        f->mapped = mapped;
+        f->verbatim = verbatim;
+        f->last_site = last_site;
+        f->out = out;
+        f->out_size = out_size;
+        f->out_length = out_length;
+        f->sink = sink;
+        f->sink_closure = sink_closure;
+        f->source = source;
+        f->source_end = source_end;
+        memcpy(f->escape, escape, sizeof(jmp_buf));
+        f->stream = stream;
+        f->finishing = finishing;
+        f->failure = failure;
+        f->start = start;
+        f->consumed = consumed;
+        f->lines = lines;
+        f->after_cr = after_cr;
+        f->opening = opening;
+        f->opening_line = opening_line;
+        f->twice = twice;
+        f->reading = reading;
+        f->state = state;
+        f->back = back;
+        f->code_left = code_left;
+        f->left = left;
+        f->paren = paren;
+        f->node = node;
+        f->word = word;
+        f->cmd_nr = cmd_nr;
+        buffer = NULL;
+        buffer_size = 0;
+        out = NULL;
+        out_size = 0;
+        out_length = 0;
+        sink = NULL;
+        sink_closure = NULL;
+        stream = NULL;
+        finishing = false;
+        failure = NULL;
+    }
+    depth += 1;
+}
+
+
+static void
+leave(struct frame* f)
+{
+/*
+    End a call. If another call was running, free the buffers of this one and
+    put back the state of the other.
+*/
+    depth -= 1;
+    if (depth > 0) {
+        free(buffer);
+        if (out != NULL) {
+            free(out);
+            pthread_setspecific(out_key, f->out);
+        }
+        context = f->context;
+        buffer = f->buffer;
+        buffer_size = f->buffer_size;
+        at = f->at;
+        limit = f->limit;
+        mark = f->mark;
+        hold = f->hold;
+        at_eof = f->at_eof;
+        mapped = f->mapped;
+        verbatim = f->verbatim;
+        last_site = f->last_site;
+        out = f->out;
+        out_size = f->out_size;
+        out_length = f->out_length;
+        sink = f->sink;
+        sink_closure = f->sink_closure;
+        source = f->source;
+        source_end = f->source_end;
+        memcpy(escape, f->escape, sizeof(jmp_buf));
+        stream = f->stream;
+        finishing = f->finishing;
+        failure = f->failure;
+        start = f->start;
+        consumed = f->consumed;
+        lines = f->lines;
+        after_cr = f->after_cr;
+        opening = f->opening;
+        opening_line = f->opening_line;
+        twice = f->twice;
+        reading = f->reading;
+        state = f->state;
+        back = f->back;
+        code_left = f->code_left;
+        left = f->left;
+        paren = f->paren;
+        node = f->node;
+        word = f->word;
+        cmd_nr = f->cmd_nr;
+    }
+}
+
+
+extern jsdev_ctx*
+jsdev_new(void)
+{
+    struct jsdev_ctx* ctx;
+    pthread_once(&scanners_selected, select_scanners);
+    ctx = (struct jsdev_ctx*) calloc(1, sizeof(struct jsdev_ctx));
+    if (ctx != NULL) {
+        ctx->edges = no_edges;
+        ctx->edges_size = 1;
+    }
+    return ctx;
+}
+
+
+extern void
+jsdev_free(jsdev_ctx* ctx)
+{
+    if (ctx == NULL) {
+        return;
+    }
+    free(ctx->arena);
+    free(ctx->entries);
+    free(ctx->accepts);
+    if (ctx->edges != no_edges) {
+        free(ctx->edges);
+    }
+    free(ctx->header);
+    free(ctx);
+}
+
+
+static size_t
+name_length(const char* s)
+{
+/*
+    Return the length of a cmd or command, or 0 if it is not well formed.
+*/
+    size_t i;
+    for (i = 0; is_alphanum((unsigned char) s[i]); i += 1) {
+    }
+    return s[i] == 0 ? i : 0;
+}
+
+
+static void
+add_comment(const char* text)
+{
+/*
+    Add a line comment to the header of the context.
+*/
+    size_t length = strlen(text);
+    context->header = (char*) enlarge(context->header, &context->header_size,
+            context->header_length + length + 5);
+    strcpy(context->header + context->header_length, "// ");
+    strcat(context->header + context->header_length, text);
+    strcat(context->header + context->header_length, "\n");
+    context->header_length += length + 4;
+}
+
+
+extern int
+jsdev_declare(jsdev_ctx* ctx, const char* cmd, const char* command)
+{
+/*
+    Nothing that changes is kept in a local across the setjmp, so the length
+    of the cmd is found again inside.
+*/
+    struct jsdev_error problem;
+    struct frame frame;
+    if (name_length(cmd) == 0 ||
+            (command != NULL && name_length(command) == 0)) {
+        return JSDEV_BAD_CMD;
+    }
+    enter(&frame);
+    context = ctx;
+    reading = false;
+    problem.status = JSDEV_OK;
+    failure = &problem;
+    if (setjmp(escape) == 0) {
+        declare((char*) cmd, name_length(cmd), (char*) command);
+    }
+    failure = NULL;
+    leave(&frame);
+    return problem.status;
+}
+
+
+extern int
+jsdev_comment(jsdev_ctx* ctx, const char* text)
+{
+    struct jsdev_error problem;
+    struct frame frame;
+    enter(&frame);
+    context = ctx;
+    reading = false;
+    problem.status = JSDEV_OK;
+    failure = &problem;
+    if (setjmp(escape) == 0) {
+        add_comment(text);
+    }
+    failure = NULL;
+    leave(&frame);
+    return problem.status;
+}
+
+
+extern int
+jsdev_process(const jsdev_ctx* ctx, const char* in, size_t in_len,
+        jsdev_out out, void* closure, struct jsdev_error* problem)
+{
+/*
+    The program is copied into the buffer a block at a time by fill, and the
+    output goes to the sink. Nothing is mapped, so nothing is transferred.
+    The error is reached through failure after the setjmp, and not through a
+    local that could be clobbered by the longjmp.
+*/
+    struct jsdev_error ignored;
+    struct frame frame;
+    int status;
+    enter(&frame);
+    reset();
+    context = (struct jsdev_ctx*) ctx;
+    source = (unsigned char*) (in != NULL ? in : "");
+    source_end = source + (in != NULL ? in_len : 0);
+    sink = out;
+    sink_closure = closure;
+    failure = problem != NULL ? problem : &ignored;
+    failure->status = JSDEV_OK;
+    failure->line = 0;
+    failure->offset = 0;
+    failure->message = NULL;
+    if (setjmp(escape) == 0) {
+        reading = true;
+        if (context->header_length > 0) {
+            emits(context->header);
+        }
+        process();
+    }
+    status = failure->status;
+    failure = NULL;
+    sink = NULL;
+    sink_closure = NULL;
+    reset();
+    free(buffer);
+    buffer = NULL;
+    buffer_size = 0;
+    leave(&frame);
+    return status;
+}
+
+
+static void
+suspend()
+{
+/*
+    The piece is used up. Keep what the next feed needs to go on from here,
+    and escape from the lexer.
+*/
+    size_t held = hold != NULL ? (size_t) (at - hold) : 0;
+    count_to(hold != NULL ? hold : at);
+    take(&stream->resume);
+    if (held > 0) {
+        stream->held = (unsigned char*) enlarge(stream->held,
+                &stream->held_size, held);
+        memcpy(stream->held, hold, held);
+    }
+    stream->consumed = consumed;
+    stream->lines = lines;
+    stream->after_cr = after_cr;
+    stream->opening = opening;
+    stream->opening_line = opening_line;
+    stream->twice = twice;
+    stream->word = word;
+    flush();
+    longjmp(escape, 1);
+}
+
+
+static void
+resume(struct jsdev_stream* s)
+{
+/*
+    Set up the input and the lexer to go on with a stream. The held characters
+    are put in the buffer and gotten again, and then the next piece follows
+    them.
+*/
+    struct snapshot* r = &s->resume;
+    reset();
+    stream = s;
+    context = s->ctx;
+    sink = s->out;
+    sink_closure = s->closure;
+    reading = true;
+    consumed = s->consumed;
+    lines = s->lines;
+    after_cr = s->after_cr;
+    opening = s->opening;
+    opening_line = s->opening_line;
+    twice = s->twice;
+    word = s->word;
+    state = r->state;
+    back = r->back;
+    code_left = r->code_left;
+    left = r->left;
+    paren = r->paren;
+    node = r->node;
+    cmd_nr = r->cmd_nr;
+    if (r->held > 0) {
+        source = s->held;
+        source_end = s->held + r->held;
+        fill();
+        hold = at;
+        at += r->held;
+    }
+}
+
+
+static int
+go_on(struct jsdev_stream* s, const char* piece, size_t length,
+        struct jsdev_error* problem)
+{
+/*
+    Lex a piece of a stream, or the end of it if finishing. The lexer runs
+    until the piece is used up, or until the program ends or fails. Once it
+    has ended, the rest is ignored.
+*/
+    if (s->running) {
+        if (problem != NULL) {
+            problem->status = JSDEV_BUSY;
+            problem->line = 0;
+            problem->offset = 0;
+            problem->message = "the stream is running.";
+        }
+        return JSDEV_BUSY;
+    }
+    if (s->problem.status == JSDEV_OK && !s->ended) {
+        s->running = true;
+        failure = &s->problem;
+        if (setjmp(escape) == 0) {
+            resume(s);
+            source = (unsigned char*) (piece != NULL ? piece : "");
+            source_end = source + (piece != NULL ? length : 0);
+            if (!s->started) {
+                s->started = true;
+                if (context->header_length > 0) {
+                    emits(context->header);
+                }
+            }
+            lex();
+            pass();
+            flush();
+            s->ended = true;
+        }
+        s->running = false;
+        failure = NULL;
+        stream = NULL;
+        sink = NULL;
+        sink_closure = NULL;
+        reset();
+    }
+    if (problem != NULL) {
+        *problem = s->problem;
+    }
+    return s->problem.status;
+}
+
+
+extern jsdev_stream*
+jsdev_open(const jsdev_ctx* ctx, jsdev_out out, void* closure)
+{
+    struct jsdev_stream* s;
+    s = (struct jsdev_stream*) calloc(1, sizeof(struct jsdev_stream));
+    if (s != NULL) {
+        s->ctx = (struct jsdev_ctx*) ctx;
+        s->out = out;
+        s->closure = closure;
+        s->resume.state = CODE;
+        s->resume.back = CODE;
+        s->resume.cmd_nr = EOF;
+        s->problem.status = JSDEV_OK;
+    }
+    return s;
+}
+
+
+extern int
+jsdev_feed(jsdev_stream* s, const char* piece, size_t length,
+        struct jsdev_error* problem)
+{
+    struct frame frame;
+    int status;
+    enter(&frame);
+    status = go_on(s, piece, length, problem);
+    leave(&frame);
+    return status;
+}
+
+
+extern int
+jsdev_finish(jsdev_stream* s, struct jsdev_error* problem)
+{
+    struct frame frame;
+    int status;
+    enter(&frame);
+    finishing = true;
+    status = go_on(s, NULL, 0, problem);
+    finishing = false;
+    free(buffer);
+    buffer = NULL;
+    buffer_size = 0;
+    leave(&frame);
+    return status;
+}
+
+
+extern void
+jsdev_close(jsdev_stream* s)
+{
+    if (s != NULL) {
+        free(s->held);
+        free(s);
+    }
+}
+
+
+#ifndef JSDEV_LIBRARY
+
+/*
+    In a batch, many files are processed in one run, each into its own output
+    file. A failure in one is written into report, and escapes to the next
+    file. The reports are put on stderr in the order of the files, whichever
+    thread processed them.
+
+    The files are shared by the threads with work stealing. They are sorted by
+    size, largest first, and dealt out to the queues. A queue is a slice of
+    order, from head to tail, packed into one word so that both ends can be
+    changed by a compare and swap. A thread takes from the head of its own
+    queue, so it does its largest files first. When it runs out, it steals
+    from the tail of another queue.
+*/
+
+#define REPORT_SIZE    1024
+
+struct file {
+    char*   name;
+    off_t   size;
+    char*   report;     /* the complaint, or NULL */
+    int     done;
+};
+
+struct queue {
+    uint64_t span;      /* head in the high half, tail in the low half */
+    char     gap[56];   /* so that the queues do not share a cache line */
+};
+
+LOCAL char            report[REPORT_SIZE];
+static struct jsdev_ctx* batch_context = NULL;
+static struct file*   files = NULL;
+static int*           order = NULL;
+static struct queue*  queues = NULL;
+static int            nr_queues = 0;
+static int            next_report = 0;
+static int            batch_failed = false;
+static pthread_mutex_t reporting = PTHREAD_MUTEX_INITIALIZER;
+static char**         names = NULL;
+static size_t         names_size = 0;
+static int            nr_names = 0;
+static char*          out_dir = NULL;
+static char*          out_suffix = NULL;
+
+
+/*
+    With -cache <directory>, each output is kept in the directory, so that a
+    program that has not changed is not processed again. An output is named
+    'o' and the hash of the rest of the input, seeded with the hash of the
+    configuration: the header, which holds the comments, and then each cmd
+    and its command. The cmds are hashed in the order of their names, so the
+    order in which they were declared does not matter.
+
+    Hashing the input means reading all of it, so there is also an index,
+    named 's' and the hash of the input's device, inode, size, times, and
+    offset. It holds the hash of the input, so an input that has not been
+    touched since it was seen is not read at all.
+
+    An output that is found is copied as a reflink if the file system allows
+    it, or else by the kernel. It is never a hard link, because a later run
+    without the cache would truncate the entry along with the output. A new
+    output is written to a temporary file that is renamed into place only if
+    the program is processed without error, and only then is the index entry
+    written. Only mapped input is cached.
+
+    Nothing is ever removed from the cache. An entry that is no longer wanted
+    stays until the user clears the directory, which can be done at any time,
+    even while jsdev is running.
+
+    The hash is XXH64.
+*/
+
+#define CACHE_VERSION  2
+#define PRIME_1        11400714785074694791ULL
+#define PRIME_2        14029467366897019727ULL
+#define PRIME_3        1609587929392839161ULL
+#define PRIME_4        9650029242287828579ULL
+#define PRIME_5        2870177450012600261ULL
+#define rotate(x, r)   (((x) << (r)) | ((x) >> (64 - (r))))
+
+static char*          cache_dir = NULL;
+static uint64_t       config_hash = 0;
+LOCAL uint64_t        cache_key;
+LOCAL char            cache_index[sizeof(cache_temp)];
+
+
+static uint64_t
+read_64(const unsigned char* p)
+{
+    uint64_t x;
+    memcpy(&x, p, 8);
+    return x;
+}
+
+
+static uint64_t
+mix(uint64_t acc, uint64_t input)
+{
+    acc += input * PRIME_2;
+    acc = rotate(acc, 31);
+    return acc * PRIME_1;
+}
+
+
+static uint64_t
+merge(uint64_t acc, uint64_t lane)
+{
+    acc ^= mix(0, lane);
+    return acc * PRIME_1 + PRIME_4;
+}
+
+
+static uint64_t
+xxh64(const unsigned char* p, size_t length, uint64_t seed)
+{
+    const unsigned char* end = p + length;
+    uint64_t h, v1, v2, v3, v4;
+    uint32_t k;
+
+    if (length >= 32) {
+        v1 = seed + PRIME_1 + PRIME_2;
+        v2 = seed + PRIME_2;
+        v3 = seed;
+        v4 = seed - PRIME_1;
+        do {
+            v1 = mix(v1, read_64(p));
+            v2 = mix(v2, read_64(p + 8));
+            v3 = mix(v3, read_64(p + 16));
+            v4 = mix(v4, read_64(p + 24));
+            p += 32;
+        } while (p <= end - 32);
+        h = rotate(v1, 1) + rotate(v2, 7) + rotate(v3, 12) + rotate(v4, 18);
+        h = merge(h, v1);
+        h = merge(h, v2);
+        h = merge(h, v3);
+        h = merge(h, v4);
+    } else {
+        h = seed + PRIME_5;
+    }
+    h += (uint64_t) length;
+    while (p + 8 <= end) {
+        h ^= mix(0, read_64(p));
+        h = rotate(h, 27) * PRIME_1 + PRIME_4;
+        p += 8;
+    }
+    if (p + 4 <= end) {
+        memcpy(&k, p, 4);
+        h ^= (uint64_t) k * PRIME_1;
+        h = rotate(h, 23) * PRIME_2 + PRIME_3;
+        p += 4;
+    }
+    while (p < end) {
+        h ^= (uint64_t) *p * PRIME_5;
+        h = rotate(h, 11) * PRIME_1;
+        p += 1;
+    }
+    h ^= h >> 33;
+    h *= PRIME_2;
+    h ^= h >> 29;
+    h *= PRIME_3;
+    h ^= h >> 32;
+    return h;
+}
+
+
+static int
+by_name(const void* a, const void* b)
+{
+/*
+    Order the entries of the context by the names of their cmds.
+*/
+    const struct entry* x = (const struct entry*) a;
+    const struct entry* y = (const struct entry*) b;
+    size_t length = x->length < y->length ? x->length : y->length;
+    int order = memcmp(context->arena + x->name, context->arena + y->name,
+            length);
+    if (order != 0) {
+        return order;
+    }
+    return x->length < y->length ? -1 : x->length > y->length ? 1 : 0;
+}
+
+
+static uint64_t
+hash_config()
+{
+/*
+    Hash the configuration of the context: the header, and then each cmd and
+    its command in the order of the cmds. A cmd without a command leaves the
+    hash as it is, which an empty command does not.
+*/
+    struct entry* entries;
+    struct entry* e;
+    char* command;
+    uint64_t h;
+    int i;
+    entries = (struct entry*) malloc((size_t) context->nr_cmds *
+            sizeof(struct entry) + 1);
+    if (entries == NULL) {
+        error("out of memory.");
+    }
+    memcpy(entries, context->entries,
+            (size_t) context->nr_cmds * sizeof(struct entry));
+    qsort(entries, (size_t) context->nr_cmds, sizeof(struct entry), by_name);
+    h = xxh64((unsigned char*) context->header, context->header_length,
+            CACHE_VERSION);
+    for (i = 0; i < context->nr_cmds; i += 1) {
+        e = &entries[i];
+        h = xxh64((unsigned char*) context->arena + e->name, e->length, h);
+        if (e->command != NO_COMMAND) {
+            command = context->arena + e->command;
+            h = xxh64((unsigned char*) command, strlen(command), h + 1);
+        }
+    }
+    free(entries);
+    return h;
+}
+
+
+static void
+cache_name(char* name, int kind, uint64_t key)
+{
+    snprintf(name, sizeof(cache_temp), "%s/%c%016llx", cache_dir, kind,
+            (unsigned long long) key);
+}
+
+
+static void
+write_index(char* index, uint64_t key)
+{
+/*
+    Note the hash of an input in its index entry. It is written to a temporary
+    file and renamed, so that a reader never sees half of it.
+*/
+    char temp[sizeof(cache_temp) + 64];
+    char text[17];
+    int fd;
+    snprintf(temp, sizeof(temp), "%s.%d.%lx", index, (int) getpid(),
+            (unsigned long) pthread_self());
+    snprintf(text, sizeof(text), "%016llx", (unsigned long long) key);
+    fd = open(temp, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0) {
+        return;
+    }
+    if (write(fd, text, 16) == 16) {
+        close(fd);
+        rename(temp, index);
+    } else {
+        close(fd);
+        unlink(temp);
+    }
+}
+
+
+static int
+find_output(char* name)
+{
+/*
+    Look in the cache for the output of the mapped input, and put the name of
+    its entry in name. Return true if it is there. If it is not, start making
+    it. The index entry is written by end_output, once the output is stored.
+*/
+    struct stat status;
+    uint64_t facts[8];
+    char text[17];
+    int fd;
+
+    if (fstat(in_fd, &status) != 0) {
+        return false;
+    }
+    facts[0] = (uint64_t) status.st_dev;
+    facts[1] = (uint64_t) status.st_ino;
+    facts[2] = (uint64_t) status.st_size;
+    facts[3] = (uint64_t) status.st_mtim.tv_sec;
+    facts[4] = (uint64_t) status.st_mtim.tv_nsec;
+    facts[5] = (uint64_t) status.st_ctim.tv_sec;
+    facts[6] = (uint64_t) status.st_ctim.tv_nsec;
+    facts[7] = (uint64_t) (map_offset + (at - map_start));
+    cache_name(cache_index, 's', xxh64((unsigned char*) facts, sizeof(facts),
+            config_hash));
+    fd = open(cache_index, O_RDONLY);
+    if (fd >= 0) {
+        text[16] = 0;
+        if (read(fd, text, 16) == 16) {
+            cache_name(name, 'o', strtoull(text, NULL, 16));
+            if (access(name, R_OK) == 0) {
+                close(fd);
+                return true;
+            }
+        }
+        close(fd);
+    }
+    cache_key = xxh64(at, (size_t) (limit - at), config_hash);
+    cache_name(name, 'o', cache_key);
+    if (access(name, R_OK) == 0) {
+        write_index(cache_index, cache_key);
+        return true;
+    }
+    snprintf(cache_temp, sizeof(cache_temp), "%s.%d.%lx", name,
+            (int) getpid(), (unsigned long) pthread_self());
+    cache_fd = open(cache_temp, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    return false;
+}
+
+
+static void
+end_output(int ok)
+{
+/*
+    Finish the cache entry that is being made, and then its index entry, or
+    drop it.
+*/
+    char name[sizeof(cache_temp)];
+    if (cache_fd < 0) {
+        return;
+    }
+    close(cache_fd);
+    cache_fd = -1;
+    cache_name(name, 'o', cache_key);
+    if (ok && rename(cache_temp, name) == 0) {
+        write_index(cache_index, cache_key);
+    } else {
+        unlink(cache_temp);
+    }
+}
+
+
+static int
+write_all(int fd, const void* p, size_t length)
+{
+    ssize_t n;
+    while (length > 0) {
+        n = write(fd, p, length);
+        if (n < 0 && errno != EINTR) {
+            return false;
+        }
+        if (n > 0) {
+            p = (const char*) p + n;
+            length -= (size_t) n;
+        }
+    }
+    return true;
+}
+
+
+static int
+copy_output(char* name, int to)
+{
+/*
+    Copy a cache entry to the output: as a reflink, or else by the kernel, or
+    else by read and write. The output never shares an inode with the entry.
+    Return false if it could not be done.
+*/
+    struct stat status;
+    char block[TRANSFER_SIZE];
+    off_t offset = 0;
+    ssize_t n = 0;
+    int from = open(name, O_RDONLY), ok = false;
+
+    if (from < 0 || fstat(from, &status) != 0) {
+        if (from >= 0) {
+            close(from);
+        }
+        return false;
+    }
+#ifdef __linux__
+    if (lseek(to, 0, SEEK_CUR) == 0 && ioctl(to, FICLONE, from) == 0) {
+        lseek(to, status.st_size, SEEK_SET);
+        close(from);
+        return true;
+    }
+    while (offset < status.st_size) {
+        errno = 0;
+        n = copy_file_range(from, &offset, to, NULL,
+                (size_t) (status.st_size - offset), 0);
+        if (n == 0 || (n < 0 && errno != EINTR)) {
+            break;
+        }
+    }
+    while (offset < status.st_size) {
+        errno = 0;
+        n = sendfile(to, from, &offset, (size_t) (status.st_size - offset));
+        if (n == 0 || (n < 0 && errno != EINTR)) {
+            break;
+        }
+    }
+#endif
+    while (offset < status.st_size) {
+        errno = 0;
+        n = pread(from, block, TRANSFER_SIZE, offset);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0 || !write_all(to, block, (size_t) n)) {
+            break;
+        }
+        offset += n;
+    }
+    ok = offset == status.st_size;
+    close(from);
+    return ok;
+}
+
+
+static void
+add_name(char* name)
+{
+    names = (char**) enlarge(names, &names_size,
+            (nr_names + 1) * sizeof(char*));
+    names[nr_names] = name;
+    nr_names += 1;
+}
+
+
+static char*
+slurp(int fd)
+{
+/*
+    Read all of a file into a string.
+*/
+    char* s = NULL;
+    size_t size = 0, length = 0;
+    ssize_t n;
+    for (;;) {
+        s = (char*) enlarge(s, &size, length + BLOCK_SIZE + 1);
+        n = read(fd, s + length, BLOCK_SIZE);
+        if (n > 0) {
+            length += n;
+        } else if (n == 0) {
+            break;
+        } else if (errno != EINTR) {
+            fail(JSDEV_READ_ERROR, "read error.");
+        }
+    }
+    s[length] = 0;
+    return s;
+}
+
+
+static void
+add_list(char* list, int separator)
+{
+/*
+    Add the names in a list, which are separated by the separator. Carriage
+    returns at the ends of lines and empty names are ignored.
+*/
+    char* end;
+    size_t length;
+    while (*list) {
+        end = strchr(list, separator);
+        if (end == NULL) {
+            end = list + strlen(list);
+        } else {
+            *end = 0;
+            end += 1;
+        }
+        length = strlen(list);
+        if (separator == '\n' && length > 0 && list[length - 1] == '\r') {
+            list[length - 1] = 0;
+        }
+        if (*list) {
+            add_name(list);
+        }
+        list = end;
+    }
+}
+
+
+static void
+add_response_file(char* name)
+{
+    int fd = open(name, O_RDONLY);
+    if (fd < 0) {
+        error(name);
+    }
+    add_list(slurp(fd), '\n');
+    close(fd);
+}
+
+
+static void
+add_names_from_stdin()
+{
+/*
+    Add the names on stdin, which are separated by NUL characters.
+*/
+    char* list = slurp(in_fd);
+    char* p;
+    for (p = list; *p; p += strlen(p) + 1) {
+        add_name(p);
+    }
+}
+
+
+static char*
+output_name(char* name)
+{
+/*
+    Make the name of the output file of a file in the batch: the name with
+    the suffix, or the name within the output directory.
+*/
+    char* path;
+    size_t length = strlen(name);
+    if (out_suffix != NULL) {
+        path = (char*) malloc(length + strlen(out_suffix) + 1);
+        if (path != NULL) {
+            strcpy(path, name);
+            strcat(path, out_suffix);
+        }
+    } else {
+        while (name[0] == '/') {
+            name += 1;
+        }
+        path = (char*) malloc(strlen(out_dir) + length + 2);
+        if (path != NULL) {
+            strcpy(path, out_dir);
+            strcat(path, "/");
+            strcat(path, name);
+        }
+    }
+    return path;
+}
+
+
+static void
+make_directories(char* path)
+{
+/*
+    Make the directories that the path goes through.
+*/
+    char* p;
+    for (p = path + 1; *p; p += 1) {
+        if (*p == '/') {
+            *p = 0;
+            mkdir(path, 0777);
+            *p = '/';
+        }
+    }
+}
+
+
+static void
+complain(char* name, char* message)
+{
+    snprintf(report, REPORT_SIZE, "JSDev: %s: %s\r\n", name, message);
+}
+
+
+static int
+make_output(char* name, char* path)
+{
+/*
+    Process the file that is open on in_fd into the output that is open on
+    out_fd, or copy it from the cache. Return true if that worked, or else
+    put the reason in the report and return false.
+*/
+    char entry[4096];
+    struct jsdev_error problem;
+
+    failure = &problem;
+    reading = true;
+    if (setjmp(escape) != 0) {
+        snprintf(report, REPORT_SIZE, "JSDev: %s: %d. %s\r\n", name,
+                problem.line, problem.message);
+        return false;
+    }
+    map_input();
+    if (mapped && cache_dir != NULL && find_output(entry)) {
+        if (!copy_output(entry, out_fd)) {
+            complain(path, "write error.");
+            return false;
+        }
+        return true;
+    }
+    if (context->header_length > 0) {
+        emits(context->header);
+    }
+    if (mapped) {
+        last_site = locate();
+        verbatim = last_site == NULL;
+    }
+    process();
+    return true;
+}
+
+
+static int
+process_file(char* name)
+{
+/*
+    Process a file of the batch into its output file. If there is an error,
+    it is reported, the output file is removed, and false is returned.
+*/
+    char* path = output_name(name);
+    struct stat input, output;
+    int ok = false;
+
+    report[0] = 0;
+    if (path == NULL) {
+        complain(name, "out of memory.");
+        return false;
+    }
+    reset();
+    in_fd = open(name, O_RDONLY);
+    if (in_fd < 0) {
+        complain(name, "can't open.");
+        free(path);
+        return false;
+    }
+/*
+    An output that is the input itself would be truncated before it is read.
+*/
+    if (fstat(in_fd, &input) == 0 && stat(path, &output) == 0 &&
+            input.st_dev == output.st_dev && input.st_ino == output.st_ino) {
+        complain(path, "is the program itself.");
+        close(in_fd);
+        in_fd = 0;
+        free(path);
+        return false;
+    }
+    out_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (out_fd < 0 && errno == ENOENT) {
+        make_directories(path);
+        out_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    }
+    if (out_fd < 0) {
+        complain(path, "can't create.");
+    } else {
+        ok = make_output(name, path);
+        failure = NULL;
+        end_output(ok);
+        if (mapped) {
+            munmap(map_start, map_length);
+        }
+        close(out_fd);
+        if (!ok) {
+            unlink(path);
+        }
+    }
+    close(in_fd);
+    in_fd = 0;
+    out_fd = 1;
+    free(path);
+    return ok;
+}
+
+
+static int
+by_size(const void* a, const void* b)
+{
+/*
+    Order the files largest first, and then by their place in the batch.
+*/
+    const struct file* x = &files[*(const int*) a];
+    const struct file* y = &files[*(const int*) b];
+    if (x->size != y->size) {
+        return x->size > y->size ? -1 : 1;
+    }
+    return *(const int*) a - *(const int*) b;
+}
+
+
+static int
+take_file(int q, int steal)
+{
+/*
+    Take a file from the head of a queue, or steal one from its tail. Return
+    EOF if the queue is empty.
+*/
+    uint64_t span, head, tail;
+    span = __atomic_load_n(&queues[q].span, __ATOMIC_ACQUIRE);
+    for (;;) {
+        head = span >> 32;
+        tail = span & 0xFFFFFFFF;
+        if (head >= tail) {
+            return EOF;
+        }
+        if (steal) {
+            tail -= 1;
+        } else {
+            head += 1;
+        }
+        if (__atomic_compare_exchange_n(&queues[q].span, &span,
+                (head << 32) | tail, false, __ATOMIC_ACQ_REL,
+                __ATOMIC_ACQUIRE)) {
+            return order[steal ? tail : head - 1];
+        }
+    }
+}
+
+
+static void
+finish_file(int f, int ok)
+{
+/*
+    Note that a file is done, and put on stderr the reports of all of the files
+    that are done and that are not waiting for an earlier file.
+*/
+    pthread_mutex_lock(&reporting);
+    if (!ok) {
+        files[f].report = strdup(report);
+        batch_failed = true;
+    }
+    files[f].done = true;
+    while (next_report < nr_names && files[next_report].done) {
+        if (files[next_report].report != NULL) {
+            fputs(files[next_report].report, stderr);
+            free(files[next_report].report);
+            files[next_report].report = NULL;
+        }
+        next_report += 1;
+    }
+    pthread_mutex_unlock(&reporting);
+}
+
+
+static void*
+work_batch(void* queue)
+{
+/*
+    A thread processes the files of its own queue, and then steals from the
+    others until they are all empty.
+*/
+    int f, q = (int) (intptr_t) queue, i;
+    context = batch_context;
+    for (;;) {
+        f = take_file(q, false);
+        for (i = 1; f == EOF && i < nr_queues; i += 1) {
+            f = take_file((q + i) % nr_queues, true);
+        }
+        if (f == EOF) {
+            break;
+        }
+        finish_file(f, process_file(files[f].name));
+    }
+    free(buffer);
+    buffer = NULL;
+    buffer_size = 0;
+    return queue;
+}
+
+
+static int
+process_batch(int nr_threads)
+{
+/*
+    Process the files of the batch with up to nr_threads threads. The calling
+    thread is one of them. Return false if any of the files failed.
+*/
+    pthread_t threads[256];
+    struct stat status;
+    int* sorted;
+    int i, q, k, started = 0;
+
+    if (nr_names == 0) {
+        return true;
+    }
+    if (nr_threads > nr_names) {
+        nr_threads = nr_names;
+    }
+    if (nr_threads > 256) {
+        nr_threads = 256;
+    }
+    if (nr_threads < 1) {
+        nr_threads = 1;
+    }
+    files = (struct file*) calloc(nr_names, sizeof(struct file));
+    order = (int*) malloc(nr_names * sizeof(int));
+    sorted = (int*) malloc(nr_names * sizeof(int));
+    queues = (struct queue*) calloc(nr_threads, sizeof(struct queue));
+    if (files == NULL || order == NULL || sorted == NULL || queues == NULL) {
+        fail(JSDEV_NO_MEMORY, "out of memory.");
+    }
+    for (i = 0; i < nr_names; i += 1) {
+        files[i].name = names[i];
+        files[i].size = stat(names[i], &status) == 0 ? status.st_size : 0;
+        sorted[i] = i;
+    }
+    qsort(sorted, nr_names, sizeof(int), by_size);
+
+/*
+    Deal the sorted files to the queues, so that each queue is also sorted and
+    gets about the same share of the big ones. Each queue is a slice of order.
+*/
+    nr_queues = nr_threads;
+    batch_context = context;
+    k = 0;
+    for (q = 0; q < nr_queues; q += 1) {
+        queues[q].span = (uint64_t) k << 32;
+        for (i = q; i < nr_names; i += nr_queues) {
+            order[k] = sorted[i];
+            k += 1;
+        }
+        queues[q].span |= (uint64_t) k;
+    }
+    free(sorted);
+    for (q = 1; q < nr_queues; q += 1) {
+        if (pthread_create(&threads[started], NULL, work_batch,
+                (void*) (intptr_t) q) == 0) {
+            started += 1;
+        }
+    }
+    work_batch((void*) 0);
+    for (i = 0; i < started; i += 1) {
+        pthread_join(threads[i], NULL);
+    }
+    return !batch_failed;
+}
+
+
+/*
+    jsdev --serve [<socket>] is a daemon that processes programs for clients
+    on a Unix domain socket, so that they do not each pay for starting up. The
+    socket is $JSDEV_SOCKET, or else jsdev.sock in $XDG_RUNTIME_DIR, or else
+    in /tmp/jsdev-<uid>. A directory that another user could write in is not
+    used. The daemon and its clients check that the other end of a connection
+    is run by the same user, so that neither talks to an impostor.
+
+    A request and its answer are made of frames: a type character, a 4 byte
+    length in host order, and that many bytes. A request is some 'a' frames,
+    which are the arguments of a command line, and then either a 'p' frame,
+    which is the path of a program, or 'i' frames, which are the pieces of a
+    program. It ends with a 'z' frame. The answer is 'o' frames of output, an
+    'e' frame for stderr if there is an error, and an 'x' frame holding the
+    exit status. jsdevc is a client that acts like the program.
+
+    Each connection is answered by its own thread. The cmd tables are cached,
+    keyed by the canonical form of their declarations: the first declaration
+    of each cmd, in the order of the cmds. The options that only change how
+    fast the program runs are not part of the key, and neither are comments,
+    which are added to a view of the table that belongs to the request. At
+    most MAX_TABLES are kept. A table is counted as used by each request that
+    has it, and only one that is not in use is evicted, the least recently
+    used first. If all of them are in use, a new table is used by its request
+    alone, and freed after.
+*/
+
+#define SOCKET_NAME    "jsdev.sock"
+#define MAX_FRAME      16777216
+
+#define MAX_TABLES     16
+
+struct table {
+    uint64_t          hash;
+    char*             key;
+    size_t            key_length;
+    struct jsdev_ctx* ctx;
+    int               users;
+    uint64_t          used;
+};
+
+struct decl {
+    char*  text;
+    size_t length;
+    int    nr;
+};
+
+struct request {
+    struct decl* decls;
+    size_t       decls_size;
+    int          nr_decls;
+    char**       comments;
+    size_t       comments_size;
+    int          nr_comments;
+    char*        key;
+    size_t       key_size;
+    size_t       key_length;
+};
+
+static struct table   tables[MAX_TABLES];
+static uint64_t       ticks = 0;
+static pthread_mutex_t caching = PTHREAD_MUTEX_INITIALIZER;
+
+
+static int
+read_all(int fd, void* p, size_t length)
+{
+    ssize_t n;
+    while (length > 0) {
+        n = read(fd, p, length);
+        if (n == 0 || (n < 0 && errno != EINTR)) {
+            return false;
+        }
+        if (n > 0) {
+            p = (char*) p + n;
+            length -= (size_t) n;
+        }
+    }
+    return true;
+}
+
+
+static int
+write_frame(int fd, int type, const void* p, size_t length)
+{
+    unsigned char head[5];
+    uint32_t n = (uint32_t) length;
+    head[0] = (unsigned char) type;
+    memcpy(head + 1, &n, 4);
+    return write_all(fd, head, 5) && write_all(fd, p, length);
+}
+
+
+static int
+write_output(void* fd, const char* p, size_t length)
+{
+    return write_frame((int) (intptr_t) fd, 'o', p, length) ? 0 : 1;
+}
+
+
+static int
+read_frame(int fd, char** frame, size_t* size, uint32_t* length)
+{
+/*
+    Read a frame into a buffer that grows as needed, NUL terminated. Return
+    its type, or EOF.
+*/
+    unsigned char head[5];
+    if (!read_all(fd, head, 5)) {
+        return EOF;
+    }
+    memcpy(length, head + 1, 4);
+    if (*length > MAX_FRAME) {
+        return EOF;
+    }
+    *frame = (char*) enlarge(*frame, size, *length + 1);
+    if (!read_all(fd, *frame, *length)) {
+        return EOF;
+    }
+    (*frame)[*length] = 0;
+    return head[0];
+}
+
+
+static uint64_t
+hash(const char* p, size_t length)
+{
+/*
+    FNV-1a.
+*/
+    uint64_t h = 14695981039346656037ULL;
+    size_t i;
+    for (i = 0; i < length; i += 1) {
+        h = (h ^ (unsigned char) p[i]) * 1099511628211ULL;
+    }
+    return h;
+}
+
+
+static char*
+socket_path(char* path, size_t size)
+{
+/*
+    Put the path of the socket in path: $JSDEV_SOCKET, or else jsdev.sock in
+    $XDG_RUNTIME_DIR, or else in /tmp/jsdev-<uid>, which is made if it is
+    missing. The directory must belong to the user, and no one else may use
+    it. Return NULL if it doesn't.
+*/
+    struct stat status;
+    char* name = getenv("JSDEV_SOCKET");
+    char* dir = getenv("XDG_RUNTIME_DIR");
+    if (name != NULL) {
+        snprintf(path, size, "%s", name);
+        return path;
+    }
+    if (dir != NULL && dir[0] == '/') {
+        snprintf(path, size, "%s", dir);
+    } else {
+        snprintf(path, size, "/tmp/jsdev-%d", (int) getuid());
+        mkdir(path, 0700);
+    }
+    if (lstat(path, &status) != 0 || !S_ISDIR(status.st_mode) ||
+            status.st_uid != getuid() || (status.st_mode & 077) != 0) {
+        return NULL;
+    }
+    snprintf(path + strlen(path), size - strlen(path), "/%s", SOCKET_NAME);
+    return path;
+}
+
+
+static int
+same_user(int fd)
+{
+/*
+    Return true if the other end of a connection is run by the same user.
+*/
+#ifdef SO_PEERCRED
+    struct ucred peer;
+    socklen_t length = sizeof(peer);
+    return getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &peer, &length) == 0 &&
+            peer.uid == getuid();
+#else
+    uid_t uid;
+    gid_t gid;
+    return getpeereid(fd, &uid, &gid) == 0 && uid == getuid();
+#endif
+}
+
+
+static int
+valid(char* arg, size_t* length)
+{
+/*
+    Return true if an argument is a well formed <cmd> or <cmd>:<command>, and
+    put the length of the cmd in length.
+*/
+    char* colon = strchr(arg, ':');
+    int ok;
+    if (colon != NULL) {
+        *colon = 0;
+    }
+    *length = name_length(arg);
+    ok = *length > 0 && (colon == NULL || name_length(colon + 1) > 0);
+    if (colon != NULL) {
+        *colon = ':';
+    }
+    return ok;
+}
+
+
+static char*
+parse(char* args, size_t args_length, struct request* r)
+{
+/*
+    Sort the arguments, which are each NUL terminated, into declarations and
+    comments, the way main reads a command line. An option that takes a value
+    takes the next argument, whatever it is, and is ignored if there is none.
+    The options that only change how fast the program runs are ignored, and
+    so is -cache, which only applies to a program in a file. Return NULL, or
+    else the argument that is bad.
+*/
+    char* arg;
+    char* option = NULL;
+    size_t length;
+    for (arg = args; arg < args + args_length; arg += strlen(arg) + 1) {
+        if (option != NULL) {
+            if (strcmp(option, "-comment") == 0) {
+                r->comments = (char**) enlarge(r->comments,
+                        &r->comments_size,
+                        (r->nr_comments + 1) * sizeof(char*));
+                r->comments[r->nr_comments] = arg;
+                r->nr_comments += 1;
+            } else if (strcmp(option, "-parallel") == 0 && atoi(arg) < 1) {
+                return arg;
+            }
+            option = NULL;
+        } else if (strcmp(arg, "-comment") == 0 ||
+                strcmp(arg, "-parallel") == 0 ||
+                strcmp(arg, "-cache") == 0) {
+            option = arg;
+        } else if (strcmp(arg, "-pipeline") == 0 ||
+                strcmp(arg, "-stalls") == 0 || strcmp(arg, "-uring") == 0) {
+            continue;
+        } else if (valid(arg, &length)) {
+            r->decls = (struct decl*) enlarge(r->decls, &r->decls_size,
+                    (r->nr_decls + 1) * sizeof(struct decl));
+            r->decls[r->nr_decls].text = arg;
+            r->decls[r->nr_decls].length = length;
+            r->decls[r->nr_decls].nr = r->nr_decls;
+            r->nr_decls += 1;
+        } else {
+            return arg;
+        }
+    }
+    return NULL;
+}
+
+
+static int
+by_cmd(const void* a, const void* b)
+{
+/*
+    Order the declarations by their cmds, and then by their places in the
+    command line.
+*/
+    const struct decl* x = (const struct decl*) a;
+    const struct decl* y = (const struct decl*) b;
+    size_t length = x->length < y->length ? x->length : y->length;
+    int order = memcmp(x->text, y->text, length);
+    if (order != 0) {
+        return order;
+    }
+    if (x->length != y->length) {
+        return x->length < y->length ? -1 : 1;
+    }
+    return x->nr - y->nr;
+}
+
+
+static void
+canonize(struct request* r)
+{
+/*
+    Make the key of the declarations: the first declaration of each cmd, in
+    the order of the cmds, each NUL terminated.
+*/
+    struct decl* d;
+    size_t length;
+    int i;
+    qsort(r->decls, (size_t) r->nr_decls, sizeof(struct decl), by_cmd);
+    r->key_length = 0;
+    r->key = (char*) enlarge(r->key, &r->key_size, 1);
+    for (i = 0; i < r->nr_decls; i += 1) {
+        d = &r->decls[i];
+        if (i > 0 && d->length == d[-1].length &&
+                memcmp(d->text, d[-1].text, d->length) == 0) {
+            continue;
+        }
+        length = strlen(d->text) + 1;
+        r->key = (char*) enlarge(r->key, &r->key_size,
+                r->key_length + length);
+        memcpy(r->key + r->key_length, d->text, length);
+        r->key_length += length;
+    }
+}
+
+
+static struct jsdev_ctx*
+make_table(char* key, size_t key_length)
+{
+/*
+    Make a context from the declarations in a key. Return NULL if there is no
+    memory.
+*/
+    struct jsdev_ctx* ctx = jsdev_new();
+    char* text;
+    char* colon;
+    int status = JSDEV_OK;
+    for (text = key; ctx != NULL && status == JSDEV_OK &&
+            text < key + key_length; text += strlen(text) + 1) {
+        colon = strchr(text, ':');
+        if (colon != NULL) {
+            *colon = 0;
+        }
+        status = jsdev_declare(ctx, text, colon != NULL ? colon + 1 : NULL);
+        if (colon != NULL) {
+            *colon = ':';
+        }
+    }
+    if (status != JSDEV_OK) {
+        jsdev_free(ctx);
+        ctx = NULL;
+    }
+    return ctx;
+}
+
+
+static struct jsdev_ctx*
+find_table(char* key, size_t key_length, int* slot)
+{
+/*
+    Return the table for a key, making it if it is new, and count the request
+    as one of its users. Put where it is kept in slot, or EOF if it is not
+    kept. Return NULL if there is no memory.
+*/
+    uint64_t h = hash(key, key_length);
+    struct jsdev_ctx* ctx;
+    char* copy = NULL;
+    int i, victim = EOF;
+    pthread_mutex_lock(&caching);
+    ticks += 1;
+    for (i = 0; i < MAX_TABLES; i += 1) {
+        if (tables[i].ctx != NULL && tables[i].hash == h &&
+                tables[i].key_length == key_length &&
+                memcmp(tables[i].key, key, key_length) == 0) {
+            tables[i].users += 1;
+            tables[i].used = ticks;
+            pthread_mutex_unlock(&caching);
+            *slot = i;
+            return tables[i].ctx;
+        }
+        if (tables[i].users == 0 &&
+                (victim == EOF || tables[i].used < tables[victim].used)) {
+            victim = i;
+        }
+    }
+    ctx = make_table(key, key_length);
+    if (ctx != NULL && victim != EOF) {
+        copy = (char*) malloc(key_length + 1);
+    }
+    if (copy != NULL) {
+        memcpy(copy, key, key_length);
+        jsdev_free(tables[victim].ctx);
+        free(tables[victim].key);
+        tables[victim].hash = h;
+        tables[victim].key = copy;
+        tables[victim].key_length = key_length;
+        tables[victim].ctx = ctx;
+        tables[victim].users = 1;
+        tables[victim].used = ticks;
+        *slot = victim;
+    } else {
+        *slot = EOF;
+    }
+    pthread_mutex_unlock(&caching);
+    return ctx;
+}
+
+
+static void
+release_table(struct jsdev_ctx* ctx, int slot)
+{
+/*
+    The request is done with its table.
+*/
+    if (slot == EOF) {
+        jsdev_free(ctx);
+    } else {
+        pthread_mutex_lock(&caching);
+        tables[slot].users -= 1;
+        pthread_mutex_unlock(&caching);
+    }
+}
+
+
+static char*
+feed_file(struct jsdev_stream* s, char* path)
+{
+/*
+    Feed a file to a stream a block at a time. Return NULL, or what went
+    wrong.
+*/
+    ssize_t n;
+    char* block;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return "can't open.";
+    }
+    block = (char*) malloc(BLOCK_SIZE);
+    if (block == NULL) {
+        close(fd);
+        return "out of memory.";
+    }
+    for (;;) {
+        n = read(fd, block, BLOCK_SIZE);
+        if (n == 0) {
+            break;
+        }
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            free(block);
+            close(fd);
+            return "read error.";
+        }
+        if (jsdev_feed(s, block, (size_t) n, NULL) != JSDEV_OK) {
+            break;
+        }
+    }
+    free(block);
+    close(fd);
+    return NULL;
+}
+
+
+static void*
+answer(void* connection)
+{
+/*
+    Answer the request of a connection, and close it.
+*/
+    int fd = (int) (intptr_t) connection, type, slot = EOF, i;
+    char* frame = NULL;
+    char* args = NULL;
+    char* bad = NULL;
+    char* trouble = NULL;
+    char* name = NULL;
+    char message[REPORT_SIZE];
+    size_t frame_size = 0, args_size = 0, args_length = 0;
+    uint32_t length;
+    struct request r;
+    struct jsdev_ctx* ctx = NULL;
+    struct jsdev_ctx view;
+    struct jsdev_stream* s = NULL;
+    struct jsdev_error problem;
+
+    memset(&r, 0, sizeof(r));
+    memset(&view, 0, sizeof(view));
+    type = read_frame(fd, &frame, &frame_size, &length);
+    while (type == 'a') {
+        args = (char*) enlarge(args, &args_size, args_length + length + 1);
+        memcpy(args + args_length, frame, length + 1);
+        args_length += length + 1;
+        type = read_frame(fd, &frame, &frame_size, &length);
+    }
+    bad = parse(args, args_length, &r);
+    if (bad == NULL) {
+        canonize(&r);
+        ctx = find_table(r.key, r.key_length, &slot);
+        if (ctx == NULL) {
+            bad = "out of memory.";
+        }
+    }
+
+/*
+    The view shares the table of the context, and has its own header.
+*/
+
+    if (ctx != NULL) {
+        view = *ctx;
+        view.header = NULL;
+        view.header_size = 0;
+        view.header_length = 0;
+        for (i = 0; i < r.nr_comments && trouble == NULL; i += 1) {
+            if (jsdev_comment(&view, r.comments[i]) != JSDEV_OK) {
+                trouble = "out of memory.";
+            }
+        }
+        if (trouble == NULL) {
+            s = jsdev_open(&view, write_output, connection);
+            if (s == NULL) {
+                trouble = "out of memory.";
+            }
+        }
+    }
+    if (type == 'p') {
+        name = strdup(frame);
+        if (s != NULL && name != NULL) {
+            trouble = feed_file(s, frame);
+        }
+        type = read_frame(fd, &frame, &frame_size, &length);
+    }
+    while (type == 'i') {
+        if (s != NULL && trouble == NULL) {
+            jsdev_feed(s, frame, length, NULL);
+        }
+        type = read_frame(fd, &frame, &frame_size, &length);
+    }
+    if (type == 'z') {
+        if (bad != NULL) {
+            snprintf(message, REPORT_SIZE, "JSDev: bad command line %s\r\n",
+                    bad);
+        } else if (trouble != NULL) {
+            snprintf(message, REPORT_SIZE, "JSDev: %s: %s\r\n", name, trouble);
+        } else if (jsdev_finish(s, &problem) != JSDEV_OK) {
+            snprintf(message, REPORT_SIZE, "JSDev: %d. %s\r\n", problem.line,
+                    problem.message);
+        } else {
+            message[0] = 0;
+        }
+        if (message[0] != 0) {
+            write_frame(fd, 'e', message, strlen(message));
+        }
+        write_frame(fd, 'x', message[0] != 0 ? "\1" : "\0", 1);
+    }
+    jsdev_close(s);
+    free(view.header);
+    if (ctx != NULL) {
+        release_table(ctx, slot);
+    }
+    free(r.decls);
+    free(r.comments);
+    free(r.key);
+    free(frame);
+    free(args);
+    free(name);
+    close(fd);
+    return connection;
+}
+
+
+static void
+serve(char* path)
+{
+/*
+    Listen on the socket, answering each connection in its own thread. A
+    socket left by an earlier daemon of the user is replaced. Anything else
+    at the path is left alone.
+*/
+    struct sockaddr_un address;
+    struct stat status;
+    pthread_attr_t attributes;
+    pthread_t thread;
+    int listener, fd;
+
+    if (strlen(path) >= sizeof(address.sun_path)) {
+        error(path);
+    }
+    signal(SIGPIPE, SIG_IGN);
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, path);
+    if (lstat(path, &status) == 0) {
+        if (!S_ISSOCK(status.st_mode) || status.st_uid != getuid()) {
+            error("the socket path is taken by something else.");
+        }
+        unlink(path);
+    }
+    listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listener < 0 ||
+            bind(listener, (struct sockaddr*) &address, sizeof(address)) != 0 ||
+            listen(listener, 64) != 0) {
+        error("can't listen.");
+    }
+    pthread_attr_init(&attributes);
+    pthread_attr_setdetachstate(&attributes, PTHREAD_CREATE_DETACHED);
+    for (;;) {
+        fd = accept(listener, NULL, NULL);
+        if (fd < 0) {
+            continue;
+        }
+        if (!same_user(fd)) {
+            close(fd);
+            continue;
+        }
+        if (pthread_create(&thread, &attributes, answer,
+                (void*) (intptr_t) fd) != 0) {
+            answer((void*) (intptr_t) fd);
+        }
+    }
+}
+
+
+static void
+declare_arg(char* text)
+{
+/*
+    Declare a cmd written as <cmd> or <cmd>:<command>.
+*/
+    char* colon = strchr(text, ':');
+    int status;
+    if (colon != NULL) {
+        *colon = 0;
+    }
+    status = jsdev_declare(context, text, colon != NULL ? colon + 1 : NULL);
+    if (colon != NULL) {
+        *colon = ':';
+    }
+    if (status == JSDEV_BAD_CMD) {
+        error(text);
+    } else if (status != JSDEV_OK) {
+        error("out of memory.");
+    }
+}
+
+
+static void
+declare_file(char* name)
+{
+/*
+    Declare the cmds in a file, which are separated by whitespace.
+*/
+    char* list;
+    char* text;
+    int fd = open(name, O_RDONLY);
+    if (fd < 0) {
+        error(name);
+    }
+    list = slurp(fd);
+    close(fd);
+    for (text = strtok(list, " \t\r\n"); text != NULL;
+            text = strtok(NULL, " \t\r\n")) {
+        declare_arg(text);
+    }
+    free(list);
+}
+
+
+extern int
 main(int argc, char* argv[])
 {
-    int c, comment = false, i, j, k;
-    cr = false;
-    line_nr = 0;
-    nr_cmds = 0;
+    char* path;
+    int comment = false, parallel = false, nr_threads = 0, pipeline = false,
+        stalls = false, uring = false, dir = false, suffix = false,
+        only_files = false, cache = false, cmds = false, i;
+    char name[4096];
+
+    if (argc > 1 && strcmp(argv[1], "--serve") == 0) {
+        path = argc > 2 ? argv[2] : socket_path(name, sizeof(name));
+        if (path == NULL) {
+            error("the socket directory is not safe.");
+        }
+        serve(path);
+    }
+    context = jsdev_new();
+    if (context == NULL) {
+        error("out of memory.");
+    }
     for (i = 1; i < argc; i += 1) {
-        if (comment) {
+        if (only_files) {
+            add_name(argv[i]);
+        } else if (comment) {
             comment = false;
-            emits("// ");
-            emits(argv[i]);
-            emit('\n');
-        } else if (strcmp(argv[i], "-comment") == 0) {
-            comment = true;
-        } else {
-            for (j = 0; j < MAX_CMD_LENGTH; j += 1) {
-                c = argv[i][j];
-                if (!is_alphanum(c)) {
-                    break;
-                }
-                cmds[nr_cmds][j] = c;
+            if (jsdev_comment(context, argv[i]) != JSDEV_OK) {
+                error("out of memory.");
             }
-            if (j == 0) {
+        } else if (dir) {
+            dir = false;
+            out_dir = argv[i];
+        } else if (suffix) {
+            suffix = false;
+            out_suffix = argv[i];
+        } else if (cache) {
+            cache = false;
+            cache_dir = argv[i];
+        } else if (cmds) {
+            cmds = false;
+            declare_file(argv[i]);
+        } else if (parallel) {
+            parallel = false;
+            nr_threads = atoi(argv[i]);
+            if (nr_threads < 1) {
                 error(argv[i]);
             }
-            cmds[nr_cmds][j] = 0;
-            if (c == 0) {
-                commands[nr_cmds][0] = 0;
-            } else if (c == ':') {
-                j += 1;
-                for (k = 0; k < MAX_CMD_LENGTH; k += 1) {
-                    c = argv[i][j + k];
-                    if (!is_alphanum(c)) {
-                        break;
-                    }
-                    commands[nr_cmds][k] = c;
-                }
-                commands[nr_cmds][k] = 0;
-                if (k == 0 || c != 0) {
-                    error(argv[i]);
-                }
-            } else {
-                error(argv[i]);
+        } else if (strcmp(argv[i], "-comment") == 0) {
+            comment = true;
+        } else if (strcmp(argv[i], "-parallel") == 0) {
+            parallel = true;
+        } else if (strcmp(argv[i], "-pipeline") == 0) {
+            pipeline = true;
+        } else if (strcmp(argv[i], "-stalls") == 0) {
+            pipeline = true;
+            stalls = true;
+        } else if (strcmp(argv[i], "-uring") == 0) {
+            uring = true;
+        } else if (strcmp(argv[i], "-dir") == 0) {
+            dir = true;
+        } else if (strcmp(argv[i], "-suffix") == 0) {
+            suffix = true;
+        } else if (strcmp(argv[i], "-cache") == 0) {
+            cache = true;
+        } else if (strcmp(argv[i], "-cmds") == 0) {
+            cmds = true;
+        } else if (strcmp(argv[i], "-files0") == 0) {
+            add_names_from_stdin();
+        } else if (strcmp(argv[i], "--") == 0) {
+            only_files = true;
+        } else if (argv[i][0] == '@') {
+            add_response_file(argv[i] + 1);
+        } else {
+            declare_arg(argv[i]);
+        }
+    }
+    if (cache_dir != NULL) {
+        if (mkdir(cache_dir, 0777) != 0 && errno != EEXIST) {
+            error(cache_dir);
+        }
+        config_hash = hash_config();
+    }
+    if (out_dir != NULL || out_suffix != NULL || nr_names > 0) {
+        if (out_dir == NULL && out_suffix == NULL) {
+            error("batch mode needs -dir or -suffix.");
+        }
+        if (nr_threads == 0) {
+            nr_threads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+        }
+        return process_batch(nr_threads) ? 0 : 1;
+    }
+    map_input();
+    if (mapped && cache_dir != NULL && find_output(name)) {
+        if (!copy_output(name, out_fd)) {
+            error("write error.");
+        }
+        return 0;
+    }
+    if (context->header_length > 0) {
+        emits(context->header);
+    }
+    if (mapped) {
+        last_site = locate();
+        verbatim = last_site == NULL;
+    }
+    if (mapped && nr_threads > 1) {
+        process_in_parallel(nr_threads);
+    } else if (!mapped && pipeline) {
+        start_pipeline();
+        process();
+        if (pipelined) {
+            finish();
+            if (stalls) {
+                fprintf(stderr, "JSDev: stalls: reader %.3fs, lexer %.3fs "
+                        "for input and %.3fs for output, writer %.3fs.\r\n",
+                        reader_stall, input_stall, output_stall,
+                        writer_stall);
             }
-            nr_cmds += 1;
         }
+    } else if (!mapped && uring && uring_setup()) {
+        process();
+        uring_finish();
+    } else {
+        process();
     }
-    process();
+    end_output(true);
     return 0;
 }
+
+#endif
@@ -0,0 +1,129 @@
+/*  jsdev.h
+    2026-10-15
+
+    Public Domain
+
+    The interface to libjsdev, which does what the jsdev program does, but to
+    a program in memory, inside of another program.
+
+    A context holds a table of cmds and their commands, and the comments that
+    go at the top of the output. It is built once, and then it can be used to
+    process any number of programs. It is not changed by processing, so many
+    threads can process with the same context at the same time.
+
+    The output is given to a function, in pieces, as it is made. The function
+    returns 0 to go on, or anything else to stop.
+
+    A failure does not exit. It is described in a jsdev_error: the status, the
+    message, and the line and offset in the input where it was found. As with
+    the program, the output up to a syntax error is given before it returns.
+
+    The functions are reentrant. An output function can call any of them, for
+    example to process a program that it found in the output. But it can't
+    feed or finish the stream that it is getting output from, which returns
+    JSDEV_BUSY, and it can't close that stream or free a context that is in
+    use.
+*/
+
+#ifndef JSDEV_H
+#define JSDEV_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+enum jsdev_status {
+    JSDEV_OK,
+    JSDEV_SYNTAX_ERROR,     /* the program is malformed */
+    JSDEV_BAD_CMD,          /* a cmd or command is not well formed */
+    JSDEV_NO_MEMORY,
+    JSDEV_READ_ERROR,
+    JSDEV_WRITE_ERROR,      /* the output function asked to stop */
+    JSDEV_BUSY              /* the stream was fed from its own output */
+};
+
+struct jsdev_error {
+    int         status;
+    int         line;       /* the line of the failure, counting from 1 */
+    size_t      offset;     /* the offset of the failure in the input */
+    const char* message;
+};
+
+typedef struct jsdev_ctx jsdev_ctx;
+
+typedef int (*jsdev_out)(void* closure, const char* data, size_t length);
+
+/*
+    Make an empty context, or return NULL if there is no memory.
+*/
+extern jsdev_ctx* jsdev_new(void);
+
+/*
+    Free a context.
+*/
+extern void jsdev_free(jsdev_ctx* ctx);
+
+/*
+    Declare a cmd, and the command that it calls, which may be NULL. A cmd
+    and a command are made of letters, digits, underscores, dollar signs, and
+    periods. If a cmd is declared twice, the first one wins.
+*/
+extern int jsdev_declare(jsdev_ctx* ctx, const char* cmd,
+        const char* command);
+
+/*
+    Add a comment to the top of every output.
+*/
+extern int jsdev_comment(jsdev_ctx* ctx, const char* text);
+
+/*
+    Process a program, giving the output to out. The error may be NULL.
+    Return the status. All in_len characters are processed. A NUL is not a
+    character of the program: it ends a line comment, leaves a literal or a
+    comment unterminated, and is dropped anywhere else.
+*/
+extern int jsdev_process(const jsdev_ctx* ctx, const char* in, size_t in_len,
+        jsdev_out out, void* closure, struct jsdev_error* error);
+
+/*
+    A stream processes a program that arrives in pieces of any size. Each
+    piece is lexed as it is fed, and the output that is certain so far is
+    given to out before the feed returns. A piece is copied as needed, so it
+    can be reused as soon as the feed returns. After a failure, the stream
+    only returns the same status.
+*/
+
+typedef struct jsdev_stream jsdev_stream;
+
+/*
+    Open a stream with a context, which must outlive it. Return NULL if there
+    is no memory.
+*/
+extern jsdev_stream* jsdev_open(const jsdev_ctx* ctx, jsdev_out out,
+        void* closure);
+
+/*
+    Process the next piece of the program, all length characters of it, as
+    jsdev_process would. The error may be NULL.
+*/
+extern int jsdev_feed(jsdev_stream* stream, const char* piece, size_t length,
+        struct jsdev_error* error);
+
+/*
+    Process the end of the program, which is where an unterminated literal or
+    comment is found. The error may be NULL.
+*/
+extern int jsdev_finish(jsdev_stream* stream, struct jsdev_error* error);
+
+/*
+    Free a stream.
+*/
+extern void jsdev_close(jsdev_stream* stream);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
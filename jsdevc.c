@@ -0,0 +1,358 @@
+/*  jsdevc.c
+    2026-10-15
+
+    Public Domain
+
+    jsdevc is a client of jsdev --serve. It takes the same command line as
+    jsdev, reads a program from stdin, and writes the modified program to
+    stdout, so it can be used in its place. The work is done by the daemon,
+    which has the cmd table ready, so nothing is started up for each program.
+
+    The socket is $JSDEV_SOCKET, or else jsdev.sock in $XDG_RUNTIME_DIR, or
+    else in /tmp/jsdev-<uid>, as jsdev.c describes. If there is no daemon, or
+    it is not run by the same user, jsdev itself is run with the command line.
+
+    A batch, with -dir, -suffix, --, @<list>, or -files0, is not sent to the
+    daemon, and neither is -stalls, which reports on jsdev's own pipeline, or
+    --serve. jsdev is run with the command line instead. The cmds in a -cmds
+    file are read here and sent as arguments, since the daemon can't see the
+    file the same way. -cache is sent, and the daemon ignores it, as jsdev
+    does for a program that is not in a file. Its directory is made here, as
+    jsdev would make it, and if it can't be, jsdev is run to say so. The
+    daemon reads the rest of the command line the way jsdev does, so a bad
+    one gets the same message.
+
+    The frames of a request and its answer are described in jsdev.c. The
+    program is sent by a second thread while the answer is read, so that
+    neither side waits on the other with a full socket.
+*/
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#define false          0
+#define true           1
+#define BLOCK_SIZE     65536
+#define SOCKET_NAME    "jsdev.sock"
+
+
+static int
+write_all(int fd, const void* p, size_t length)
+{
+    ssize_t n;
+    while (length > 0) {
+        n = write(fd, p, length);
+        if (n < 0 && errno != EINTR) {
+            return false;
+        }
+        if (n > 0) {
+            p = (const char*) p + n;
+            length -= (size_t) n;
+        }
+    }
+    return true;
+}
+
+
+static int
+read_all(int fd, void* p, size_t length)
+{
+    ssize_t n;
+    while (length > 0) {
+        n = read(fd, p, length);
+        if (n == 0 || (n < 0 && errno != EINTR)) {
+            return false;
+        }
+        if (n > 0) {
+            p = (char*) p + n;
+            length -= (size_t) n;
+        }
+    }
+    return true;
+}
+
+
+static int
+write_frame(int fd, int type, const void* p, size_t length)
+{
+    unsigned char head[5];
+    uint32_t n = (uint32_t) length;
+    head[0] = (unsigned char) type;
+    memcpy(head + 1, &n, 4);
+    return write_all(fd, head, 5) && write_all(fd, p, length);
+}
+
+
+static char*
+socket_path(char* path, size_t size)
+{
+/*
+    Put the path of the socket in path: $JSDEV_SOCKET, or else jsdev.sock in
+    $XDG_RUNTIME_DIR, or else in /tmp/jsdev-<uid>, which is made if it is
+    missing. The directory must belong to the user, and no one else may use
+    it. Return NULL if it doesn't.
+*/
+    struct stat status;
+    char* name = getenv("JSDEV_SOCKET");
+    char* dir = getenv("XDG_RUNTIME_DIR");
+    if (name != NULL) {
+        snprintf(path, size, "%s", name);
+        return path;
+    }
+    if (dir != NULL && dir[0] == '/') {
+        snprintf(path, size, "%s", dir);
+    } else {
+        snprintf(path, size, "/tmp/jsdev-%d", (int) getuid());
+        mkdir(path, 0700);
+    }
+    if (lstat(path, &status) != 0 || !S_ISDIR(status.st_mode) ||
+            status.st_uid != getuid() || (status.st_mode & 077) != 0) {
+        return NULL;
+    }
+    snprintf(path + strlen(path), size - strlen(path), "/%s", SOCKET_NAME);
+    return path;
+}
+
+
+static int
+same_user(int fd)
+{
+/*
+    Return true if the other end of a connection is run by the same user.
+*/
+#ifdef SO_PEERCRED
+    struct ucred peer;
+    socklen_t length = sizeof(peer);
+    return getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &peer, &length) == 0 &&
+            peer.uid == getuid();
+#else
+    uid_t uid;
+    gid_t gid;
+    return getpeereid(fd, &uid, &gid) == 0 && uid == getuid();
+#endif
+}
+
+
+static void
+run_jsdev(char* argv[])
+{
+/*
+    Run jsdev itself with the command line. An ignored SIGPIPE would be
+    ignored by jsdev too, so it is restored first.
+*/
+    signal(SIGPIPE, SIG_DFL);
+    argv[0] = "jsdev";
+    execvp("jsdev", argv);
+    fputs("JSDev: can't connect.\r\n", stderr);
+    exit(1);
+}
+
+
+static int
+needs_jsdev(char* arg)
+{
+/*
+    Return true if an option asks for something that only jsdev can do: a
+    batch, or the stalls of its pipeline.
+*/
+    return strcmp(arg, "-dir") == 0 || strcmp(arg, "-suffix") == 0 ||
+            strcmp(arg, "--") == 0 || strcmp(arg, "-files0") == 0 ||
+            strcmp(arg, "-stalls") == 0 || arg[0] == '@';
+}
+
+
+static int
+takes_value(char* arg)
+{
+    return strcmp(arg, "-comment") == 0 || strcmp(arg, "-parallel") == 0 ||
+            strcmp(arg, "-cache") == 0 || strcmp(arg, "-cmds") == 0 ||
+            strcmp(arg, "-dir") == 0 || strcmp(arg, "-suffix") == 0;
+}
+
+
+static int
+send_cmds(int fd, char* name)
+{
+/*
+    Send the cmds in a file, which are separated by whitespace, as arguments.
+    Return false if the file can't be read, or the daemon is lost.
+*/
+    char* list = NULL;
+    char* more;
+    char* text;
+    size_t size = 0, length = 0;
+    ssize_t n;
+    int file = open(name, O_RDONLY), ok = file >= 0;
+    while (ok) {
+        if (length + BLOCK_SIZE + 1 > size) {
+            size = 2 * size + BLOCK_SIZE + 1;
+            more = (char*) realloc(list, size);
+            if (more == NULL) {
+                ok = false;
+                break;
+            }
+            list = more;
+        }
+        n = read(file, list + length, BLOCK_SIZE);
+        if (n == 0) {
+            break;
+        }
+        if (n < 0 && errno != EINTR) {
+            ok = false;
+        }
+        if (n > 0) {
+            length += (size_t) n;
+        }
+    }
+    if (ok) {
+        list[length] = 0;
+        for (text = strtok(list, " \t\r\n"); ok && text != NULL;
+                text = strtok(NULL, " \t\r\n")) {
+            ok = write_frame(fd, 'a', text, strlen(text));
+        }
+    }
+    if (file >= 0) {
+        close(file);
+    }
+    free(list);
+    return ok;
+}
+
+
+static void*
+send_program(void* connection)
+{
+/*
+    Send stdin as pieces, and then the end of the request.
+*/
+    static char block[BLOCK_SIZE];
+    int fd = (int) (intptr_t) connection;
+    ssize_t n;
+    for (;;) {
+        n = read(0, block, BLOCK_SIZE);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+        if (!write_frame(fd, 'i', block, (size_t) n)) {
+            return connection;
+        }
+    }
+    write_frame(fd, 'z', NULL, 0);
+    return connection;
+}
+
+
+static int
+connect_to(char* path)
+{
+/*
+    Return a connection to the daemon, or -1 if there is none that is run by
+    the same user.
+*/
+    struct sockaddr_un address;
+    int fd;
+    if (strlen(path) >= sizeof(address.sun_path)) {
+        return -1;
+    }
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, path);
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd >= 0 &&
+            (connect(fd, (struct sockaddr*) &address, sizeof(address)) != 0 ||
+            !same_user(fd))) {
+        close(fd);
+        fd = -1;
+    }
+    return fd;
+}
+
+
+extern int
+main(int argc, char* argv[])
+{
+    unsigned char head[5];
+    uint32_t length;
+    char* frame = NULL;
+    char path[4096];
+    pthread_t sender;
+    int fd = -1, i;
+
+    if (argc > 1 && strcmp(argv[1], "--serve") == 0) {
+        run_jsdev(argv);
+    }
+    for (i = 1; i < argc; i += 1) {
+        if (needs_jsdev(argv[i])) {
+            run_jsdev(argv);
+        }
+        if (strcmp(argv[i], "-cache") == 0 && i + 1 < argc &&
+                mkdir(argv[i + 1], 0777) != 0 && errno != EEXIST) {
+            run_jsdev(argv);
+        }
+        if (takes_value(argv[i])) {
+            i += 1;
+        }
+    }
+    if (socket_path(path, sizeof(path)) != NULL) {
+        fd = connect_to(path);
+    }
+    if (fd < 0) {
+        run_jsdev(argv);
+    }
+    signal(SIGPIPE, SIG_IGN);
+    for (i = 1; i < argc; i += 1) {
+        if (strcmp(argv[i], "-cmds") == 0) {
+            i += 1;
+            if (i < argc && !send_cmds(fd, argv[i])) {
+                close(fd);
+                run_jsdev(argv);
+            }
+        } else if (!write_frame(fd, 'a', argv[i], strlen(argv[i]))) {
+            close(fd);
+            run_jsdev(argv);
+        }
+    }
+    if (pthread_create(&sender, NULL, send_program, (void*) (intptr_t) fd)
+            != 0) {
+        send_program((void*) (intptr_t) fd);
+    }
+
+/*
+    Copy the output and the error to stdout and stderr until the exit status
+    comes.
+*/
+    while (read_all(fd, head, 5)) {
+        memcpy(&length, head + 1, 4);
+        frame = (char*) realloc(frame, length + 1);
+        if (frame == NULL || !read_all(fd, frame, length)) {
+            break;
+        }
+        if (head[0] == 'o') {
+            if (!write_all(1, frame, length)) {
+                fputs("JSDev: write error.\r\n", stderr);
+                return 1;
+            }
+        } else if (head[0] == 'e') {
+            write_all(2, frame, length);
+        } else if (head[0] == 'x') {
+            return length > 0 ? frame[0] : 1;
+        }
+    }
+    fputs("JSDev: lost the daemon.\r\n", stderr);
+    return 1;
+}
@@ -0,0 +1,123 @@
+#!/bin/sh
+#   test.sh
+#   2026-10-16
+#
+#   Public Domain
+#
+#   make test runs jsdev on small programs whose outputs are known, both from
+#   a file and from a pipe, and prints each one that comes out wrong. Then it
+#   starts a daemon, and checks that jsdevc answers a command line just as
+#   jsdev does. The exit status is the number of failures.
+#
+#       check <name> <program> <output> <status> <jsdev arguments>...
+#       check_error <name> <program> <message> <jsdev arguments>...
+#       check_client <jsdev arguments>...
+#
+#   The program, the output, and the message are printf formats, so they can
+#   hold a NUL or a CR.
+
+tmp=$(mktemp -d) || exit 1
+daemon=
+trap '[ -n "$daemon" ] && kill $daemon; rm -rf "$tmp"' EXIT
+failures=0
+
+fail() {
+    echo "FAIL: $1"
+    failures=$((failures + 1))
+}
+
+check() {
+    name=$1
+    printf "$2" > "$tmp/in"
+    printf "$3" > "$tmp/want"
+    status=$4
+    shift 4
+    ./jsdev "$@" < "$tmp/in" > "$tmp/out" 2> /dev/null
+    if [ $? != "$status" ] || ! cmp -s "$tmp/want" "$tmp/out"; then
+        fail "$name (file)"
+    fi
+    cat "$tmp/in" | ./jsdev "$@" > "$tmp/out" 2> /dev/null
+    if [ $? != "$status" ] || ! cmp -s "$tmp/want" "$tmp/out"; then
+        fail "$name (pipe)"
+    fi
+}
+
+check_error() {
+    name=$1
+    printf "$2" > "$tmp/in"
+    printf "$3" > "$tmp/want"
+    shift 3
+    ./jsdev "$@" < "$tmp/in" > /dev/null 2> "$tmp/err"
+    if ! cmp -s "$tmp/want" "$tmp/err"; then
+        fail "$name (file)"
+    fi
+    cat "$tmp/in" | ./jsdev "$@" > /dev/null 2> "$tmp/err"
+    if ! cmp -s "$tmp/want" "$tmp/err"; then
+        fail "$name (pipe)"
+    fi
+}
+
+check_client() {
+    printf '/*log a*/\n' > "$tmp/in"
+    ./jsdev "$@" < "$tmp/in" > "$tmp/out" 2> "$tmp/err"
+    echo $? >> "$tmp/out"
+    PATH=/nonexistent ./jsdevc "$@" < "$tmp/in" > "$tmp/cout" 2> "$tmp/cerr"
+    echo $? >> "$tmp/cout"
+    if ! cmp -s "$tmp/out" "$tmp/cout" || ! cmp -s "$tmp/err" "$tmp/cerr"; then
+        fail "jsdevc $*"
+    fi
+}
+
+check "pattern" '/*log a*/\n' '{console.log( a);}\n' 0 log:console.log
+check "condition" '/*log(x) a*/\n' 'if (x){ a;}\n' 0 log
+check "undeclared" '/*debug a*/\n' '/*debug a*/\n' 0 log
+
+# A NUL ends a line comment and is dropped, and the rest is processed.
+
+check "NUL in a line comment" '// c\0d\nrest();\n' '// cd\nrest();\n' 0 log
+check "NUL in program text" 'a;\0b;\n' 'a;b;\n' 0 log
+check "NUL in stuff" '/*log a\0b*/\n' '{ ab;}\n' 0 log
+
+# A NUL leaves a literal unterminated, as the end of the input would.
+
+check "NUL in a string" 'a="x\0y";\nb;\n' 'a="x' 1 log
+check "NUL in a regexp" 'x=/a\0b/;\n' 'x=/a' 1 log
+check "NUL in a comment" '/* c\0d */\n' '/* c' 1 log
+
+# The line break after the first word of a comment has always been counted
+# twice, unless the word is 80 characters or longer.
+
+check_error "line after a cmd" '/*log\n a*/\nb\047' 'JSDev: 4. unterminated string literal.\r\n' log
+check_error "line after a word" '/*x\r\n*/\nb\047' 'JSDev: 4. unterminated string literal.\r\n' log
+check_error "line after a long word" '/*%080d\n*/\nb\047' 'JSDev: 3. unterminated string literal.\r\n' log
+
+# jsdevc is run without a PATH, so that it can't fall back to jsdev.
+
+JSDEV_SOCKET="$tmp/sock"
+export JSDEV_SOCKET
+./jsdev --serve &
+daemon=$!
+for i in 1 2 3 4 5 6 7 8 9 10; do
+    [ -S "$JSDEV_SOCKET" ] && break
+    sleep 1
+done
+
+check_client log
+check_client log:console.log -comment hello
+check_client log -parallel 0
+check_client log -parallel x
+check_client log -parallel
+check_client log -comment
+check_client log -cache
+check_client log -cmds
+check_client log -comment -parallel 0
+check_client log -pipeline -uring -parallel 2
+check_client bad-cmd
+check_client log:bad-command
+check_client log:a:b
+check_client -foo
+check_client ""
+check_client bad-cmd -parallel 0
+check_client log -parallel 0 bad-cmd
+
+exit $failures